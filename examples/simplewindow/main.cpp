@@ -7,6 +7,8 @@
 #include <QPlatformSurfaceEvent>
 #include <QOffscreenSurface>
 #include <QFile>
+#include <QDir>
+#include <QStandardPaths>
 
 #include "qrhiimgui.h"
 #include "imgui.h"
@@ -141,6 +143,7 @@ bool Window::event(QEvent *e)
 void Window::init()
 {
     QRhi::Flags rhiFlags = QRhi::EnableDebugMarkers
+                           | QRhi::EnablePipelineCacheDataSave
 #if QT_VERSION_MAJOR > 6 || QT_VERSION_MINOR >= 6
                            | QRhi::EnableTimestamps
 #else
@@ -207,9 +210,16 @@ void Window::init()
     m_rp.reset(m_sc->newCompatibleRenderPassDescriptor());
     m_sc->setRenderPassDescriptor(m_rp.get());
 
+    const QString cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    const bool hasCacheDir = !cacheDir.isEmpty() && QDir().mkpath(cacheDir);
+    if (hasCacheDir)
+        m_imgui.setFontAtlasCacheDirectory(cacheDir);
     m_imgui.rebuildFontAtlasWithFont(QLatin1String(":/fonts/RobotoMono-Medium.ttf"));
 
     m_imguiRenderer.reset(new QRhiImguiRenderer);
+    if (hasCacheDir)
+        m_imguiRenderer->setPipelineCacheFile(QDir(cacheDir).filePath(QLatin1String("imgui_pipelines.bin")));
+    m_imguiRenderer->prewarm(m_rhi.get(), m_rp.get(), m_sc->sampleCount());
 
     m_vbuf.reset(m_rhi->newBuffer(QRhiBuffer::Immutable, QRhiBuffer::VertexBuffer, sizeof(vertexData)));
     m_vbuf->create();
@@ -359,7 +369,7 @@ void Window::gui()
     ImGui::ShowDemoWindow(&m_showDemoWindow);
 
     ImGui::SetNextWindowPos(ImVec2(50, 120), ImGuiCond_FirstUseEver);
-    ImGui::SetNextWindowSize(ImVec2(400, 100), ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowSize(ImVec2(400, 120), ImGuiCond_FirstUseEver);
     ImGui::Begin("Test");
     static char s[512];
     bool print = false;
@@ -369,6 +379,9 @@ void Window::gui()
         print = true;
     if (print)
         qDebug("%s", s);
+    const QRhiImguiRenderer::PipelineStats ps = m_imguiRenderer->pipelineStats();
+    ImGui::Text("Pipeline creation: %.2f ms (cache %s)", ps.lastCreateNs / 1000000.0,
+                ps.cacheLoaded ? "loaded" : "not loaded");
     ImGui::End();
 }
 
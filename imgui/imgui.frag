@@ -24,9 +24,24 @@ vec3 linearToSRGB(vec3 color)
     return 0.585122381 * S1 + 0.783140355 * S2 - 0.368262736 * S3;
 }
 
+// One source for all texture kinds, the variants are built with DEFINES
+// (see imgui.cmakeinc).
 void main()
 {
+#if defined(ALPHA_TEXTURE)
+    // single channel (R8) texture with coverage only, white otherwise
+    vec4 c = v_color * vec4(1.0, 1.0, 1.0, texture(tex, v_texcoord).r);
+#elif defined(DISTANCE_FIELD_TEXTURE)
+    // Signed distance field with 0.5 at the edge, either in R8 or in the
+    // alpha of white RGBA, min() works for both. The edge is smoothed over
+    // about a pixel, whatever the scale is.
+    vec4 t = texture(tex, v_texcoord);
+    float d = min(t.r, t.a);
+    float w = max(0.5 * fwidth(d), 0.0001);
+    vec4 c = v_color * vec4(1.0, 1.0, 1.0, smoothstep(0.5 - w, 0.5 + w, d));
+#else
     vec4 c = v_color * texture(tex, v_texcoord);
+#endif
     c.a *= opacity;
     if (hdrWhiteLevelMult > 0.0)
         c.rgb *= hdrWhiteLevelMult;
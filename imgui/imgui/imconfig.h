@@ -95,7 +95,11 @@
 // Your renderer backend will need to support it (most example renderer backends support both 16/32-bit indices).
 // Another way to allow large meshes while keeping 16-bit indices is to handle ImDrawCmd::VtxOffset in your renderer.
 // Read about ImGuiBackendFlags_RendererHasVtxOffset for details.
+// (qrhiimgui handles VtxOffset, define QRHIIMGUI_16BIT_INDICES, e.g. via the
+// QRHIIMGUI_16BIT_INDICES CMake option, to use the 16-bit default)
+#ifndef QRHIIMGUI_16BIT_INDICES
 #define ImDrawIdx unsigned int
+#endif
 
 //---- Override ImDrawCallback signature (will need to modify renderer backends accordingly)
 //struct ImDrawList;
@@ -0,0 +1,23 @@
+#version 440
+
+// The compact vertex format: positions in 1/4 pixels, texture coordinates
+// normalized to 16 bits. See QRhiImgui::setCompactVertexFormat().
+layout(location = 0) in ivec2 position;
+layout(location = 1) in uvec2 texcoord;
+layout(location = 2) in vec4 color;
+
+layout(location = 0) out vec2 v_texcoord;
+layout(location = 1) out vec4 v_color;
+
+layout(std140, binding = 0) uniform buf {
+    mat4 mvp;
+    float opacity;
+    float sdrMult;
+};
+
+void main()
+{
+    v_texcoord = vec2(texcoord) / 65535.0;
+    v_color = color;
+    gl_Position = mvp * vec4(vec2(position) * 0.25, 0.0, 1.0);
+}
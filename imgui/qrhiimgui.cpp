@@ -2,30 +2,467 @@
 // SPDX-License-Identifier: LicenseRef-Qt-Commercial OR BSD-3-Clause
 
 #include "qrhiimgui.h"
+#include "qrhiimguifontatlas_p.h"
+#include "qrhiimguitexturefile_p.h"
+#include <QtCore/qbitarray.h>
 #include <QtCore/qfile.h>
+#include <QtCore/qmath.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qendian.h>
+#include <QtCore/qthreadpool.h>
 #include <QtGui/qguiapplication.h>
 #include <QtGui/qevent.h>
 #include <QtGui/qclipboard.h>
 #include <QtGui/qimage.h>
 
 #include "imgui.h"
+#include "imgui_internal.h"
+
+// For the image atlas. The one in imgui_draw.cpp is static, warnings are
+// suppressed the same way as there.
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable: 4456)                             // declaration of 'xx' hides previous local declaration
+#pragma warning (disable: 4505)                             // unreferenced local function has been removed
+#pragma warning (disable: 6011)                             // (stb_rectpack) Dereferencing NULL pointer 'cur->next'.
+#pragma warning (disable: 6385)                             // (stb_truetype) Reading invalid data from 'buffer'
+#pragma warning (disable: 28182)                            // (stb_rectpack) Dereferencing NULL pointer. 'cur' contains the same NULL value as 'cur->next' did.
+#endif
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-function"
+#pragma clang diagnostic ignored "-Wunused-parameter"
+#pragma clang diagnostic ignored "-Wmissing-prototypes"
+#pragma clang diagnostic ignored "-Wimplicit-fallthrough"
+#pragma clang diagnostic ignored "-Wcast-qual"
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wtype-limits"
+#pragma GCC diagnostic ignored "-Wcast-qual"
+#endif
+
+#define STBRP_STATIC
+#define STBRP_ASSERT(x) IM_ASSERT(x)
+#define STB_RECT_PACK_IMPLEMENTATION
+#include "imstb_rectpack.h"
+
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QRHIIMGUI_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define QRHIIMGUI_NEON
+#include <arm_neon.h>
+#endif
 
 // the imgui default
 static_assert(sizeof(ImDrawVert) == 20);
-// switched to uint in imconfig.h to avoid trouble with 4 byte offset alignment reqs
-static_assert(sizeof(ImDrawIdx) == 4);
+// uint by default in imconfig.h, ushort (the imgui default) with QRHIIMGUI_16BIT_INDICES
+static_assert(sizeof(ImDrawIdx) == 2 || sizeof(ImDrawIdx) == 4);
 
 QT_BEGIN_NAMESPACE
 
+static const QRhiCommandBuffer::IndexFormat INDEX_FORMAT = sizeof(ImDrawIdx) == 2 ? QRhiCommandBuffer::IndexUInt16
+                                                                                  : QRhiCommandBuffer::IndexUInt32;
+
+// The compact vertex format (imgui_compact.vert): positions in 1/4 pixels,
+// texture coordinates normalized to [0, 65535].
+struct CompactVertex {
+    qint16 pos[2];
+    quint16 uv[2];
+    quint32 col;
+};
+static_assert(sizeof(CompactVertex) == 12);
+
+static const float COMPACT_POS_SCALE = 4.0f;
+static const float COMPACT_POS_MIN = -32768.0f / COMPACT_POS_SCALE;
+static const float COMPACT_POS_MAX = 32767.0f / COMPACT_POS_SCALE;
+
+static inline quint32 vertexSize(bool compact)
+{
+    return compact ? sizeof(CompactVertex) : sizeof(ImDrawVert);
+}
+
+// pos and uv are the first 4 floats in ImDrawVert
+static_assert(offsetof(ImDrawVert, pos) == 0 && offsetof(ImDrawVert, uv) == 2 * sizeof(float));
+
+static bool fitsCompactVertexFormat(const ImDrawVert *v, int count)
+{
+    if (!count)
+        return true;
+    float lo[4];
+    float hi[4];
+#if defined(QRHIIMGUI_SSE2)
+    __m128 vlo = _mm_loadu_ps(&v[0].pos.x);
+    __m128 vhi = vlo;
+    for (int i = 1; i < count; ++i) {
+        const __m128 x = _mm_loadu_ps(&v[i].pos.x);
+        vlo = _mm_min_ps(vlo, x);
+        vhi = _mm_max_ps(vhi, x);
+    }
+    _mm_storeu_ps(lo, vlo);
+    _mm_storeu_ps(hi, vhi);
+#elif defined(QRHIIMGUI_NEON)
+    float32x4_t vlo = vld1q_f32(&v[0].pos.x);
+    float32x4_t vhi = vlo;
+    for (int i = 1; i < count; ++i) {
+        const float32x4_t x = vld1q_f32(&v[i].pos.x);
+        vlo = vminq_f32(vlo, x);
+        vhi = vmaxq_f32(vhi, x);
+    }
+    vst1q_f32(lo, vlo);
+    vst1q_f32(hi, vhi);
+#else
+    memcpy(lo, &v[0].pos.x, sizeof(lo));
+    memcpy(hi, &v[0].pos.x, sizeof(hi));
+    for (int i = 1; i < count; ++i) {
+        const float *x = &v[i].pos.x;
+        for (int j = 0; j < 4; ++j) {
+            lo[j] = qMin(lo[j], x[j]);
+            hi[j] = qMax(hi[j], x[j]);
+        }
+    }
+#endif
+    return lo[0] >= COMPACT_POS_MIN && lo[1] >= COMPACT_POS_MIN
+        && hi[0] <= COMPACT_POS_MAX && hi[1] <= COMPACT_POS_MAX
+        && lo[2] >= 0.0f && lo[3] >= 0.0f && hi[2] <= 1.0f && hi[3] <= 1.0f;
+}
+
+// Expects data for which fitsCompactVertexFormat() is true. The texture
+// coordinates are shifted to the signed range so that a single saturating
+// pack handles all four components, and then flipped back.
+static void convertToCompactVertexFormat(CompactVertex *dst, const ImDrawVert *src, int count)
+{
+#if defined(QRHIIMGUI_SSE2)
+    const __m128 scale = _mm_setr_ps(COMPACT_POS_SCALE, COMPACT_POS_SCALE, 65535.0f, 65535.0f);
+    const __m128 bias = _mm_setr_ps(0.0f, 0.0f, -32768.0f, -32768.0f);
+    const __m128i flip = _mm_setr_epi16(0, 0, -32768, -32768, 0, 0, 0, 0);
+    for (int i = 0; i < count; ++i) {
+        const __m128 x = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&src[i].pos.x), scale), bias);
+        __m128i r = _mm_cvtps_epi32(x);
+        r = _mm_xor_si128(_mm_packs_epi32(r, r), flip);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(&dst[i]), r);
+        dst[i].col = src[i].col;
+    }
+#elif defined(QRHIIMGUI_NEON)
+    static const float scaleData[4] = { COMPACT_POS_SCALE, COMPACT_POS_SCALE, 65535.0f, 65535.0f };
+    static const float biasData[4] = { 0.0f, 0.0f, -32768.0f, -32768.0f };
+    static const uint16_t flipData[4] = { 0, 0, 0x8000, 0x8000 };
+    const float32x4_t scale = vld1q_f32(scaleData);
+    const float32x4_t bias = vld1q_f32(biasData);
+    const uint16x4_t flip = vld1_u16(flipData);
+    for (int i = 0; i < count; ++i) {
+        const float32x4_t x = vmlaq_f32(bias, vld1q_f32(&src[i].pos.x), scale);
+        const int16x4_t r = vqmovn_s32(vcvtnq_s32_f32(x));
+        vst1_u16(reinterpret_cast<uint16_t *>(&dst[i]), veor_u16(vreinterpret_u16_s16(r), flip));
+        dst[i].col = src[i].col;
+    }
+#else
+    for (int i = 0; i < count; ++i) {
+        dst[i].pos[0] = qint16(qRound(src[i].pos.x * COMPACT_POS_SCALE));
+        dst[i].pos[1] = qint16(qRound(src[i].pos.y * COMPACT_POS_SCALE));
+        dst[i].uv[0] = quint16(qRound(src[i].uv.x * 65535.0f));
+        dst[i].uv[1] = quint16(qRound(src[i].uv.y * 65535.0f));
+        dst[i].col = src[i].col;
+    }
+#endif
+}
+
+// Shaders do not depend on the QRhi, so they are read and deserialized once
+// per process.
 static QShader getShader(const QString &name)
 {
+    static QMutex mutex;
+    static QHash<QString, QShader> shaders;
+    QMutexLocker locker(&mutex);
+    auto it = shaders.constFind(name);
+    if (it != shaders.cend())
+        return *it;
+
     QFile f(name);
-    if (f.open(QIODevice::ReadOnly))
-        return QShader::fromSerialized(f.readAll());
+    if (f.open(QIODevice::ReadOnly)) {
+        const QShader shader = QShader::fromSerialized(f.readAll());
+        if (shader.isValid())
+            shaders.insert(name, shader);
+        return shader;
+    }
 
     return QShader();
 }
 
+// Everything that does not depend on the renderer, shared by all the
+// renderers using the same QRhi, and released when the last of them releases
+// its resources. Only the registry itself is accessed from multiple threads,
+// the contents are used on the QRhi's thread only.
+class QRhiImguiSharedResources
+{
+public:
+    static QRhiImguiSharedResources *acquire(QRhi *rhi);
+    static void release(QRhi *rhi);
+
+    bool ensureCreated(QRhi *rhi);
+
+    // One sampler per distinct description, never released before the
+    // shared resources, there are only a few of these.
+    QRhiSampler *sampler(QRhi *rhi, const QRhiImguiRenderer::SamplerDescription &desc);
+    struct Sampler {
+        QRhiImguiRenderer::SamplerDescription desc;
+        std::unique_ptr<QRhiSampler> sampler;
+    };
+    std::vector<Sampler> samplers;
+    // Pipelines are created with this, so that they do not depend on any
+    // renderer's textures or uniform buffer, and can be created before any
+    // of those exist. Neither the buffer nor the texture is ever used.
+    std::unique_ptr<QRhiBuffer> layoutUbuf;
+    std::unique_ptr<QRhiTexture> layoutTexture;
+    std::unique_ptr<QRhiShaderResourceBindings> layoutSrb;
+
+    struct Pipeline {
+        QVector<quint32> renderPassFormat;
+        int sampleCount;
+        bool compactVertices;
+        QRhiImguiRenderer::TextureKind textureKind;
+        std::unique_ptr<QRhiGraphicsPipeline> ps;
+        int users; // renderers drawing with it in their current frame
+    };
+    std::vector<Pipeline> pipelines; // most recently used first
+
+    // One texture per font atlas generation, see QRhiImgui::shareFontAtlas().
+    // A texture is brought up to date in place when only updates since its
+    // base generation are needed.
+    QRhiTexture *acquireFontTexture(QRhi *rhi, const QRhiImguiRenderer::StaticRenderData &sf);
+    void releaseFontTexture(QRhiTexture *tex);
+    void uploadFontTextures(QRhiResourceUpdateBatch *u);
+    struct FontTexture {
+        quint64 generation;
+        quint64 baseGeneration;
+        std::unique_ptr<QRhiTexture> tex;
+        int users;
+        bool r8;
+        QImage pendingImage; // as in the atlas, see fontTextureImage()
+        QVector<QRect> pendingRects; // all of pendingImage when empty
+    };
+    std::vector<FontTexture> fontTextures;
+
+private:
+    int ref = 0;
+    static QMutex registryMutex;
+    static QHash<QRhi *, QRhiImguiSharedResources *> registry;
+};
+
+QMutex QRhiImguiSharedResources::registryMutex;
+QHash<QRhi *, QRhiImguiSharedResources *> QRhiImguiSharedResources::registry;
+
+QRhiImguiSharedResources *QRhiImguiSharedResources::acquire(QRhi *rhi)
+{
+    QMutexLocker locker(&registryMutex);
+    QRhiImguiSharedResources *&r(registry[rhi]);
+    if (!r)
+        r = new QRhiImguiSharedResources;
+    r->ref += 1;
+    return r;
+}
+
+void QRhiImguiSharedResources::release(QRhi *rhi)
+{
+    QMutexLocker locker(&registryMutex);
+    auto it = registry.find(rhi);
+    if (it == registry.end())
+        return;
+    if (--(*it)->ref == 0) {
+        delete *it;
+        registry.erase(it);
+    }
+}
+
+bool QRhiImguiSharedResources::ensureCreated(QRhi *rhi)
+{
+    QRhiSampler *linearSampler = sampler(rhi, QRhiSampler::Linear);
+    if (!linearSampler)
+        return false;
+
+    if (!layoutSrb) {
+        layoutUbuf.reset(rhi->newBuffer(QRhiBuffer::Dynamic, QRhiBuffer::UniformBuffer, 64 + 4 + 4));
+        layoutUbuf->setName(QByteArrayLiteral("imgui layout uniform buffer"));
+        if (!layoutUbuf->create())
+            return false;
+        layoutTexture.reset(rhi->newTexture(QRhiTexture::RGBA8, QSize(1, 1)));
+        layoutTexture->setName(QByteArrayLiteral("imgui layout texture"));
+        if (!layoutTexture->create())
+            return false;
+        layoutSrb.reset(rhi->newShaderResourceBindings());
+        layoutSrb->setBindings({
+            QRhiShaderResourceBinding::uniformBuffer(0, QRhiShaderResourceBinding::VertexStage | QRhiShaderResourceBinding::FragmentStage, layoutUbuf.get()),
+            QRhiShaderResourceBinding::sampledTexture(1, QRhiShaderResourceBinding::FragmentStage, layoutTexture.get(), linearSampler)
+        });
+        if (!layoutSrb->create())
+            return false;
+    }
+
+    return true;
+}
+
+QRhiSampler *QRhiImguiSharedResources::sampler(QRhi *rhi, const QRhiImguiRenderer::SamplerDescription &desc)
+{
+    for (const Sampler &s : samplers) {
+        if (s.desc == desc)
+            return s.sampler.get();
+    }
+    std::unique_ptr<QRhiSampler> s(rhi->newSampler(desc.magFilter, desc.minFilter, desc.mipmapMode,
+                                                   desc.addressU, desc.addressV));
+    s->setName(QByteArrayLiteral("imgui sampler"));
+    if (!s->create())
+        return nullptr;
+    samplers.push_back({ desc, std::move(s) });
+    return samplers.back().sampler.get();
+}
+
+// Single channel atlases are expanded to white with alpha when there is no
+// R8, the result is then the same as with an RGBA atlas.
+static QImage fontTextureImage(const QImage &image, bool r8)
+{
+    if (image.format() != QImage::Format_Grayscale8 || r8)
+        return image;
+    QImage data(image.size(), QImage::Format_RGBA8888);
+    for (int y = 0; y < image.height(); ++y) {
+        const uchar *src = image.constScanLine(y);
+        quint32 *dst = reinterpret_cast<quint32 *>(data.scanLine(y));
+        for (int x = 0; x < image.width(); ++x)
+            dst[x] = qToLittleEndian(0x00FFFFFFu | (quint32(src[x]) << 24));
+    }
+    return data;
+}
+
+QRhiTexture *QRhiImguiSharedResources::acquireFontTexture(QRhi *rhi, const QRhiImguiRenderer::StaticRenderData &sf)
+{
+    for (FontTexture &t : fontTextures) {
+        if (t.generation == sf.fontAtlasGeneration) {
+            t.users += 1;
+            return t.tex.get();
+        }
+    }
+    for (FontTexture &t : fontTextures) {
+        if (t.baseGeneration == sf.fontAtlasBaseGeneration && t.generation < sf.fontAtlasGeneration) {
+            // a pending full upload covers the updates as well
+            if (t.pendingImage.isNull() || !t.pendingRects.isEmpty()) {
+                for (const QRhiImguiRenderer::FontAtlasUpdate &update : sf.fontAtlasUpdates) {
+                    if (update.generation > t.generation)
+                        t.pendingRects.append(update.rect);
+                }
+            }
+            t.pendingImage = sf.fontTextureData;
+            t.generation = sf.fontAtlasGeneration;
+            t.users += 1;
+            return t.tex.get();
+        }
+    }
+    const QImage &image(sf.fontTextureData);
+    const bool r8 = image.format() == QImage::Format_Grayscale8 && rhi->isTextureFormatSupported(QRhiTexture::R8);
+    std::unique_ptr<QRhiTexture> tex(rhi->newTexture(r8 ? QRhiTexture::R8 : QRhiTexture::RGBA8, image.size()));
+    tex->setName(QByteArrayLiteral("imgui font texture ") + QByteArray::number(sf.fontAtlasBaseGeneration));
+    if (!tex->create())
+        return nullptr;
+    fontTextures.push_back({ sf.fontAtlasGeneration, sf.fontAtlasBaseGeneration, std::move(tex), 1, r8,
+                             image, {} });
+    return fontTextures.back().tex.get();
+}
+
+void QRhiImguiSharedResources::releaseFontTexture(QRhiTexture *tex)
+{
+    for (auto it = fontTextures.begin(); it != fontTextures.end(); ++it) {
+        if (it->tex.get() == tex) {
+            if (--it->users == 0)
+                fontTextures.erase(it);
+            return;
+        }
+    }
+}
+
+// Whichever renderer prepares first after a font texture got created
+// uploads it, the others are all after that within the frame. Without R8
+// only what gets uploaded is expanded, so the updated rects alone for
+// incremental updates.
+void QRhiImguiSharedResources::uploadFontTextures(QRhiResourceUpdateBatch *u)
+{
+    for (FontTexture &t : fontTextures) {
+        if (t.pendingImage.isNull())
+            continue;
+        if (t.pendingRects.isEmpty()) {
+            u->uploadTexture(t.tex.get(), fontTextureImage(t.pendingImage, t.r8));
+        } else {
+            QVarLengthArray<QRhiTextureUploadEntry, 16> entries;
+            for (const QRect &r : t.pendingRects) {
+                QRhiTextureSubresourceUploadDescription desc(fontTextureImage(t.pendingImage.copy(r), t.r8));
+                desc.setDestinationTopLeft(r.topLeft());
+                entries.append(QRhiTextureUploadEntry(0, 0, desc));
+            }
+            QRhiTextureUploadDescription desc;
+            desc.setEntries(entries.cbegin(), entries.cend());
+            u->uploadTexture(t.tex.get(), desc);
+        }
+        t.pendingImage = QImage();
+        t.pendingRects.clear();
+    }
+}
+
+// Uploads the ranges that are not in the buffer region yet. Ranges close to
+// each other are merged into one update. Whatever is in between is either
+// unused or up-to-date anyway, so uploading that as well is harmless.
+static void updateChangedRanges(QRhiResourceUpdateBatch *u,
+                                QRhiBuffer *buf,
+                                quint32 regionOffset,
+                                const QVarLengthArray<QRhiImguiRenderer::CmdListBuffer, 4> &lists,
+                                const QByteArray &data,
+                                QVector<quint64> *versions,
+                                quint64 *uploadedBytes)
+{
+    static const quint32 MERGE_GAP = 4096;
+    QVarLengthArray<QPair<quint32, quint32>, 64> ranges; // offset, size
+    for (const QRhiImguiRenderer::CmdListBuffer &b : lists) {
+        if (b.size && !std::binary_search(versions->cbegin(), versions->cend(), b.version))
+            ranges.append({ b.offset, b.size });
+    }
+    std::sort(ranges.begin(), ranges.end());
+    for (int i = 0; i < ranges.count(); ) {
+        const quint32 start = ranges[i].first;
+        quint32 end = start + ranges[i].second;
+        for (++i; i < ranges.count() && ranges[i].first - end <= MERGE_GAP; ++i)
+            end = ranges[i].first + ranges[i].second;
+        // Offsets are always 4 byte aligned, but with 16-bit indices the size
+        // may not be. Ranges have room for that, see QRhiImgui::nextFrame().
+        end = (end + 3) & ~3u;
+        u->uploadStaticBuffer(buf, regionOffset + start, end - start, data.constData() + start);
+        *uploadedBytes += end - start;
+    }
+    versions->clear();
+    for (const QRhiImguiRenderer::CmdListBuffer &b : lists)
+        versions->append(b.version);
+    std::sort(versions->begin(), versions->end());
+}
+
+// A texture of the image atlas, see QRhiImguiRenderer::setImageAtlasPolicy().
+// Space is only reused once all images in the page are gone.
+struct QRhiImguiImageAtlasPage
+{
+    int size;
+    QRhiImguiRenderer::SamplerDescription sampler;
+    std::vector<stbrp_node> nodes;
+    stbrp_context packer;
+    int images = 0;
+};
+
 QRhiImguiRenderer::~QRhiImguiRenderer()
 {
     releaseResources();
@@ -33,118 +470,460 @@ QRhiImguiRenderer::~QRhiImguiRenderer()
 
 void QRhiImguiRenderer::releaseResources()
 {
-    for (Texture &t : m_textures) {
-        if (t.ownTex)
-            delete t.tex;
-        delete t.srb;
+    for (auto it = m_textures.begin(), end = m_textures.end(); it != end; ++it) {
+        if (!it.key()) {
+            m_shared->releaseFontTexture(it->tex);
+            delete it->srb;
+        } else {
+            releaseTexture(it.key(), *it, ReleaseNow);
+        }
     }
     m_textures.clear();
+    m_fontAtlasGeneration = 0;
+    m_residentImageBytes = 0;
+    m_imageUploadQueue.clear();
+    m_imageAtlasPages.clear();
+    m_imageAtlasPlacements.clear();
+    ++m_imageAtlasVersion;
+    releaseTexture(nullptr, m_placeholder, ReleaseNow);
+    m_placeholder = {};
+    m_placeholderDirty = true;
 
-    m_vbuf.reset();
-    m_ibuf.reset();
+    m_vbuf = {};
+    m_ibuf = {};
     m_ubuf.reset();
-    m_ps.reset();
-    m_linearSampler.reset();
-    m_nearestSampler.reset();
+
+    if (m_rhi) {
+        usePipelines({});
+        savePipelineCache();
+        QRhiImguiSharedResources::release(m_rhi);
+        m_shared = nullptr;
+    }
+    m_pipelineCacheChecked = false;
 
     m_rhi = nullptr;
 }
 
-void QRhiImguiRenderer::prepare(QRhi *rhi,
-                                QRhiRenderTarget *rt,
-                                QRhiCommandBuffer *cb,
-                                const QMatrix4x4 &mvp,
-                                float opacity,
-                                float hdrWhiteLevelMultiplierOrZeroForSDRsRGB)
+void QRhiImguiRenderer::loadPipelineCache()
 {
-    if (!m_rhi) {
-        m_rhi = rhi;
-    } else if (m_rhi != rhi) {
-        releaseResources();
-        m_rhi = rhi;
+    m_pipelineCacheChecked = true;
+    if (m_pipelineCacheFile.isEmpty())
+        return;
+    QFile f(m_pipelineCacheFile);
+    if (!f.open(QIODevice::ReadOnly))
+        return;
+    const QByteArray data = f.readAll();
+    if (!data.isEmpty()) {
+        m_rhi->setPipelineCacheData(data);
+        m_pipelineStats.cacheLoaded = true;
     }
+}
 
-    if (!m_rhi || f.draw.isEmpty())
+void QRhiImguiRenderer::savePipelineCache()
+{
+    if (m_pipelineCacheFile.isEmpty())
+        return;
+    const QByteArray data = m_rhi->pipelineCacheData();
+    if (data.isEmpty())
+        return;
+    QFile f(m_pipelineCacheFile);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning("Failed to write pipeline cache to %s", qPrintable(m_pipelineCacheFile));
         return;
+    }
+    f.write(data);
+}
 
-    m_rt = rt;
-    m_cb = cb;
+// The vertex and index buffers are rings with one region per frame in
+// flight, each frame writes only to its own region (the one the GPU is
+// guaranteed to be done with), so the buffers are Static, not Dynamic: the
+// latter would be shadowed and updated per frame slot by QRhi on some
+// backends, on top of our own slots. Regions remember what they contain
+// (the versions) and receive only what changed since their last use.
+//
+// The region size grows geometrically, and shrinks only after a number of
+// frames with significantly less usage, to avoid recreating the buffer (and
+// uploading everything again) every time the size of the UI changes a bit.
+bool QRhiImguiRenderer::ensureBuffer(GeometryBuffer *b, QRhiBuffer::UsageFlag usage, quint32 size, const char *name)
+{
+    const BufferPolicy &policy(m_bufferPolicy);
+    const auto withSlack = [&policy](quint32 size) {
+        return qMax(256u, (quint32(size * qMax(1.0f, policy.growthFactor)) + 255) & ~255u);
+    };
+    const int regionCount = qMax(1, m_rhi->resourceLimit(QRhi::FramesInFlight));
 
-    if (!m_vbuf) {
-        m_vbuf.reset(m_rhi->newBuffer(QRhiBuffer::Dynamic, QRhiBuffer::VertexBuffer, f.totalVbufSize));
-        m_vbuf->setName(QByteArrayLiteral("imgui vertex buffer"));
-        if (!m_vbuf->create())
-            return;
-    } else {
-        if (f.totalVbufSize > m_vbuf->size()) {
-            m_vbuf->setSize(f.totalVbufSize);
-            if (!m_vbuf->create())
-                return;
+    quint32 newRegionSize = 0;
+    if (!b->buf || size > b->regionSize || regionCount != b->versions.count()) {
+        newRegionSize = withSlack(size);
+        if (b->buf)
+            b->stats.grows += 1;
+    } else if (b->regionSize > policy.highWaterMark) {
+        b->peakSize = qMax(b->peakSize, size);
+        if (b->peakSize * policy.growthFactor * policy.growthFactor < b->regionSize) {
+            if (++b->quietFrames >= policy.shrinkDelayFrames) {
+                newRegionSize = qMax(policy.highWaterMark, withSlack(b->peakSize));
+                b->stats.shrinks += 1;
+            }
+        } else {
+            b->quietFrames = 0;
+            b->peakSize = 0;
         }
     }
-    if (!m_ibuf) {
-        m_ibuf.reset(m_rhi->newBuffer(QRhiBuffer::Dynamic, QRhiBuffer::IndexBuffer, f.totalIbufSize));
-        m_ibuf->setName(QByteArrayLiteral("imgui index buffer"));
-        if (!m_ibuf->create())
-            return;
-    } else {
-        if (f.totalIbufSize > m_ibuf->size()) {
-            m_ibuf->setSize(f.totalIbufSize);
-            if (!m_ibuf->create())
-                return;
+
+    if (newRegionSize) {
+        b->quietFrames = 0;
+        b->peakSize = 0;
+        b->regionSize = newRegionSize;
+        b->versions.clear();
+        b->versions.resize(regionCount);
+        if (!b->buf) {
+            b->buf.reset(m_rhi->newBuffer(QRhiBuffer::Static, usage, regionCount * newRegionSize));
+            b->buf->setName(QByteArray(name));
+        } else {
+            b->buf->setSize(regionCount * newRegionSize);
         }
+        if (!b->buf->create())
+            return false;
     }
 
+    b->currentRegion = m_rhi->currentFrameSlot() % regionCount;
+    return true;
+}
+
+void QRhiImguiRenderer::useRhi(QRhi *rhi)
+{
+    if (m_rhi == rhi)
+        return;
+
+    if (m_rhi)
+        releaseResources();
+    m_rhi = rhi;
+    if (m_rhi)
+        m_shared = QRhiImguiSharedResources::acquire(m_rhi);
+
+    // SShort2 and UShort2 vertex attributes are new in 6.7
+#if QT_VERSION >= QT_VERSION_CHECK(6, 7, 0)
+    if (m_rhi)
+        m_compactVertexFormatSupported = m_rhi->isFeatureSupported(QRhi::IntAttributes);
+#endif
+}
+
+bool QRhiImguiRenderer::ensureCommonResources()
+{
     if (!m_ubuf) {
         m_ubuf.reset(m_rhi->newBuffer(QRhiBuffer::Dynamic, QRhiBuffer::UniformBuffer, 64 + 4 + 4));
         m_ubuf->setName(QByteArrayLiteral("imgui uniform buffer"));
         if (!m_ubuf->create())
-            return;
+            return false;
     }
 
-    if (!m_linearSampler) {
-        m_linearSampler.reset(m_rhi->newSampler(QRhiSampler::Linear, QRhiSampler::Linear, QRhiSampler::None,
-                                                QRhiSampler::Repeat, QRhiSampler::Repeat));
-        m_linearSampler->setName(QByteArrayLiteral("imgui linear sampler"));
-        if (!m_linearSampler->create())
-            return;
+    return m_shared->ensureCreated(m_rhi);
+}
+
+// Pipelines are kept for the last few combinations of render pass format,
+// sample count and vertex format, most recently used first, so alternating
+// between render targets (Item layers, MSAA and non-MSAA outputs) does not
+// rebuild anything. They are shared between all renderers on the QRhi.
+QRhiGraphicsPipeline *QRhiImguiRenderer::pipeline(QRhiRenderPassDescriptor *rpDesc, int sampleCount,
+                                                  bool compactVertices, TextureKind textureKind)
+{
+    // A render target needs up to TextureKindCount x 2 vertex formats = 6,
+    // keep the full sets of two (e.g. an Item layer and the window).
+    static const size_t MAX_PIPELINES = 2 * TextureKindCount * 2;
+    auto &pipelines(m_shared->pipelines);
+    const QVector<quint32> renderPassFormat = rpDesc->serializedFormat();
+    for (auto it = pipelines.begin(); it != pipelines.end(); ++it) {
+        if (it->sampleCount == sampleCount && it->compactVertices == compactVertices
+                && it->textureKind == textureKind && it->renderPassFormat == renderPassFormat) {
+            std::rotate(pipelines.begin(), it, it + 1);
+            return pipelines.front().ps.get();
+        }
     }
 
-    if (!m_nearestSampler) {
-        m_nearestSampler.reset(m_rhi->newSampler(QRhiSampler::Nearest, QRhiSampler::Nearest, QRhiSampler::None,
-                                                QRhiSampler::Repeat, QRhiSampler::Repeat));
-        m_nearestSampler->setName(QByteArrayLiteral("imgui nearest sampler"));
-        if (!m_nearestSampler->create())
-            return;
+    if (!m_pipelineCacheChecked)
+        loadPipelineCache();
+
+    QElapsedTimer createTimer;
+    createTimer.start();
+    QShader vs = getShader(compactVertices ? QLatin1String(":/imgui_compact.vert.qsb")
+                                           : QLatin1String(":/imgui.vert.qsb"));
+    static const char *fragmentShaders[TextureKindCount] = {
+        ":/imgui.frag.qsb",
+        ":/imgui_alpha.frag.qsb",
+        ":/imgui_sdf.frag.qsb"
+    };
+    QShader fs = getShader(QLatin1String(fragmentShaders[textureKind]));
+    if (!vs.isValid() || !fs.isValid()) {
+        qWarning("Failed to load imgui shaders");
+        return nullptr;
     }
 
-    if (m_textures.isEmpty()) {
-        Texture fontTex;
-        fontTex.image = sf.fontTextureData;
-        m_textures.insert(nullptr, fontTex);
-        sf.reset();
-    } else if (sf.isValid()) {
-        Texture fontTex;
-        fontTex.image = sf.fontTextureData;
-        Texture &fontTexEntry(m_textures[nullptr]);
-        delete fontTexEntry.tex;
-        delete fontTexEntry.srb;
-        fontTexEntry = fontTex;
+    std::unique_ptr<QRhiGraphicsPipeline> ps(m_rhi->newGraphicsPipeline());
+    QRhiGraphicsPipeline::TargetBlend blend;
+    blend.enable = true;
+    // Premultiplied alpha (matches imgui.frag). Would not be needed if we
+    // only cared about outputting to the window (the common case), but
+    // once going through a texture (Item layer, ShaderEffect) which is
+    // then sampled by Quick, the result wouldn't be correct otherwise.
+    blend.srcColor = QRhiGraphicsPipeline::One;
+    blend.dstColor = QRhiGraphicsPipeline::OneMinusSrcAlpha;
+    blend.srcAlpha = QRhiGraphicsPipeline::One;
+    blend.dstAlpha = QRhiGraphicsPipeline::OneMinusSrcAlpha;
+    ps->setTargetBlends({ blend });
+    ps->setCullMode(QRhiGraphicsPipeline::None);
+    ps->setDepthTest(true);
+    ps->setDepthOp(QRhiGraphicsPipeline::LessOrEqual);
+    ps->setDepthWrite(false);
+    ps->setFlags(QRhiGraphicsPipeline::UsesScissor);
+
+    ps->setShaderStages({
+        { QRhiShaderStage::Vertex, vs },
+        { QRhiShaderStage::Fragment, fs }
+    });
+
+    QRhiVertexInputLayout inputLayout;
+    if (compactVertices) {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 7, 0)
+        inputLayout.setBindings({
+            { sizeof(CompactVertex) }
+        });
+        inputLayout.setAttributes({
+            { 0, 0, QRhiVertexInputAttribute::SShort2, 0 },
+            { 0, 1, QRhiVertexInputAttribute::UShort2, 2 * sizeof(qint16) },
+            { 0, 2, QRhiVertexInputAttribute::UNormByte4, 4 * sizeof(qint16) }
+        });
+#endif
+    } else {
+        inputLayout.setBindings({
+            { 4 * sizeof(float) + sizeof(quint32) }
+        });
+        inputLayout.setAttributes({
+            { 0, 0, QRhiVertexInputAttribute::Float2, 0 },
+            { 0, 1, QRhiVertexInputAttribute::Float2, 2 * sizeof(float) },
+            { 0, 2, QRhiVertexInputAttribute::UNormByte4, 4 * sizeof(float) }
+        });
+    }
+    ps->setVertexInputLayout(inputLayout);
+    ps->setSampleCount(sampleCount);
+    ps->setShaderResourceBindings(m_shared->layoutSrb.get());
+    ps->setRenderPassDescriptor(rpDesc);
+
+    if (!ps->create())
+        return nullptr;
+
+    m_pipelineStats.created += 1;
+    m_pipelineStats.lastCreateNs = createTimer.nsecsElapsed();
+    m_pipelineStats.totalCreateNs += m_pipelineStats.lastCreateNs;
+
+    pipelines.insert(pipelines.begin(), { renderPassFormat, sampleCount, compactVertices, textureKind, std::move(ps), 0 });
+    // pipelines other renderers are about to draw with stay, even if that
+    // means going above the limit for a while
+    for (size_t i = pipelines.size(); i > MAX_PIPELINES; --i) {
+        if (!pipelines[i - 1].users) {
+            pipelines.erase(pipelines.begin() + (i - 1));
+            m_pipelineStats.evicted += 1;
+        }
+    }
+    return pipelines.front().ps.get();
+}
+
+void QRhiImguiRenderer::usePipelines(const Pipelines &ps)
+{
+    for (QRhiImguiSharedResources::Pipeline &p : m_shared->pipelines) {
+        const QRhiGraphicsPipeline *q = p.ps.get();
+        p.users += int(std::count(ps.cbegin(), ps.cend(), q)) - int(std::count(m_ps.cbegin(), m_ps.cend(), q));
+    }
+    m_ps = ps;
+}
+
+void QRhiImguiRenderer::prewarm(QRhi *rhi, QRhiRenderPassDescriptor *rpDesc, int sampleCount, bool compactVertices)
+{
+    useRhi(rhi);
+    if (!m_rhi || (compactVertices && !m_compactVertexFormatSupported))
+        return;
+    if (ensureCommonResources()) {
+        pipeline(rpDesc, sampleCount, compactVertices, ColorTexture);
+        if (m_rhi->isTextureFormatSupported(QRhiTexture::R8))
+            pipeline(rpDesc, sampleCount, compactVertices, AlphaTexture);
+        pipeline(rpDesc, sampleCount, compactVertices, DistanceFieldTexture);
+    }
+}
+
+void QRhiImguiRenderer::prepare(QRhi *rhi,
+                                QRhiRenderTarget *rt,
+                                QRhiCommandBuffer *cb,
+                                const QMatrix4x4 &mvp,
+                                float opacity,
+                                float hdrWhiteLevelMultiplierOrZeroForSDRsRGB)
+{
+    useRhi(rhi);
+
+    m_drawCalls.clear();
+
+    if (!m_rhi || f.draw.isEmpty() || (f.compactVertices && !m_compactVertexFormatSupported))
+        return;
+
+    ++m_frameCount;
+
+    m_rt = rt;
+    m_cb = cb;
+
+    if (!ensureBuffer(&m_vbuf, QRhiBuffer::VertexBuffer, f.totalVbufSize, "imgui vertex buffer"))
+        return;
+    if (!ensureBuffer(&m_ibuf, QRhiBuffer::IndexBuffer, f.totalIbufSize, "imgui index buffer"))
+        return;
+
+    if (!ensureCommonResources())
+        return;
+
+    // The font texture is shared with all renderers on the QRhi that use
+    // the same font atlas, it is not ours to delete.
+    // Acquiring before releasing the old one keeps a texture that is
+    // updated in place alive, the srb stays valid then.
+    if (sf.isValid()) {
+        QRhiTexture *tex = m_shared->acquireFontTexture(m_rhi, sf);
+        if (!tex)
+            return;
+        Texture &fontTex(m_textures[nullptr]);
+        if (fontTex.tex) {
+            m_shared->releaseFontTexture(fontTex.tex);
+            if (fontTex.tex != tex) {
+                delete fontTex.srb;
+                fontTex.srb = nullptr;
+            }
+        }
+        fontTex.tex = tex;
+        fontTex.ownTex = false;
+        if (sf.fontAtlasDistanceField)
+            fontTex.kind = DistanceFieldTexture;
+        else
+            fontTex.kind = tex->format() == QRhiTexture::R8 ? AlphaTexture : ColorTexture;
+        m_fontAtlasGeneration = sf.fontAtlasGeneration;
         sf.reset();
     }
 
-    QVarLengthArray<void *, 8> texturesNeedUpdate;
-    for (auto it = m_textures.begin(), end = m_textures.end(); it != end; ++it) {
+    // Images go in the order their conversions finished, in parts of rows
+    // when they do not fit in what is left of the budget. Only complete
+    // ones get an srb, and their mip levels generated when sampled with
+    // mipmaps. Images in the image atlas go into their page's
+    // texture in one go, and are published to QRhiImgui then. So do texture
+    // files, with their own mip levels.
+    struct ImageUpload {
+        QRhiTexture *tex;
+        QImage image;
+        QRect source;
+        QPoint destination;
+        std::shared_ptr<const QRhiImguiTextureFile> file;
+        int levelCount;
+    };
+    QVarLengthArray<ImageUpload, 4> imageUploads;
+    QVarLengthArray<QRhiTexture *, 4> mipmapsNeeded;
+    takeLoadedImages();
+    quint64 budget = m_imageUploadBudget ? m_imageUploadBudget : std::numeric_limits<quint64>::max();
+    while (!m_imageUploadQueue.isEmpty()) {
+        void *id = m_imageUploadQueue.first();
+        auto it = m_textures.find(id);
+        if (it == m_textures.end() || !it->uploadPending()) {
+            m_imageUploadQueue.removeFirst();
+            continue;
+        }
+        if (QRhiImguiImageAtlasPage *page = it->atlasPage) {
+            if (!imageUploads.isEmpty() && quint64(it->image.sizeInBytes()) > budget)
+                break;
+            Texture &pageTex(m_textures[page]);
+            if (!pageTex.tex) {
+                pageTex.tex = m_rhi->newTexture(QRhiTexture::RGBA8, QSize(page->size, page->size));
+                pageTex.tex->setName(QByteArrayLiteral("imgui image atlas page"));
+                if (!pageTex.tex->create())
+                    return;
+                pageTex.sampler = page->sampler;
+                QImage clear(page->size, page->size, QImage::Format_RGBA8888);
+                clear.fill(Qt::transparent);
+                imageUploads.append({ pageTex.tex, clear, clear.rect(), QPoint(0, 0), nullptr, 1 });
+            }
+            it = m_textures.find(id);
+            Texture &t(*it);
+            imageUploads.append({ pageTex.tex, t.image, t.image.rect(), t.atlasRect.topLeft(), nullptr, 1 });
+            budget -= qMin(budget, quint64(t.image.sizeInBytes()));
+            // the edges repeated around the image are not part of it
+            const float s = 1.0f / page->size;
+            const QRect r = t.atlasRect.adjusted(1, 1, -1, -1);
+            m_imageAtlasPlacements.insert(id, { page, ImVec2(r.x() * s, r.y() * s),
+                                                ImVec2((r.x() + r.width()) * s, (r.y() + r.height()) * s) });
+            ++m_imageAtlasVersion;
+            t.image = QImage();
+            m_imageUploadQueue.removeFirst();
+            continue;
+        }
         Texture &t(*it);
+        if (t.file) {
+            // only a complete mip chain is usable, otherwise level 0 alone
+            const QRhiImguiTextureFile &file(*t.file);
+            const bool mipmapped = t.sampler.mipmapMode != QRhiSampler::None
+                    && file.levels.size() == m_rhi->mipLevelsForSize(file.size);
+            const int levelCount = mipmapped ? int(file.levels.size()) : 1;
+            quint64 size = 0;
+            for (int level = 0; level < levelCount; ++level)
+                size += quint64(file.levels.at(level).size());
+            if (!imageUploads.isEmpty() && size > budget)
+                break;
+            t.tex = m_rhi->newTexture(file.format, file.size, 1, mipmapped ? QRhiTexture::MipMapped : QRhiTexture::Flags());
+            t.tex->setName(QByteArrayLiteral("imgui texture ") + QByteArray::number(qintptr(it.key())));
+            if (!t.tex->create())
+                return;
+            imageUploads.append({ t.tex, QImage(), QRect(), QPoint(), t.file, levelCount });
+            budget -= qMin(budget, size);
+            t.gpuSize = size;
+            m_residentImageBytes += t.gpuSize;
+            t.lastUsedFrame = m_frameCount;
+            t.file.reset();
+            m_imageUploadQueue.removeFirst();
+            continue;
+        }
+        const bool mipmapped = t.sampler.mipmapMode != QRhiSampler::None;
         if (!t.tex) {
-            t.tex = m_rhi->newTexture(QRhiTexture::RGBA8, t.image.size());
+            QRhiTexture::Flags flags;
+            if (mipmapped)
+                flags |= QRhiTexture::MipMapped | QRhiTexture::UsedWithGenerateMips;
+            t.tex = m_rhi->newTexture(QRhiTexture::RGBA8, t.image.size(), 1, flags);
             t.tex->setName(QByteArrayLiteral("imgui texture ") + QByteArray::number(qintptr(it.key())));
             if (!t.tex->create())
                 return;
-            texturesNeedUpdate.append(it.key());
+            t.gpuSize = quint64(t.image.width()) * t.image.height() * 4;
+            if (mipmapped)
+                t.gpuSize += t.gpuSize / 3;
+            m_residentImageBytes += t.gpuSize;
+            t.lastUsedFrame = m_frameCount;
+        }
+        const quint64 rowSize = quint64(t.image.bytesPerLine());
+        int rows = int(qMin(budget / rowSize, quint64(t.image.height() - t.uploadedRows)));
+        if (rows == 0 && imageUploads.isEmpty())
+            rows = 1;
+        if (rows == 0)
+            break;
+        const QRect source(0, t.uploadedRows, t.image.width(), rows);
+        imageUploads.append({ t.tex, t.image, source, source.topLeft(), nullptr, 1 });
+        budget -= qMin(budget, rows * rowSize);
+        t.uploadedRows += rows;
+        if (t.uploadedRows == t.image.height()) {
+            if (mipmapped)
+                mipmapsNeeded.append(t.tex);
+            t.image = QImage();
+            m_imageUploadQueue.removeFirst();
+        }
+    }
+
+    bool needsPlaceholder = false;
+    for (auto it = m_textures.begin(), end = m_textures.end(); it != end; ++it) {
+        Texture &t(*it);
+        if (!t.tex || t.uploadPending()) {
+            needsPlaceholder = true;
+            continue;
         }
         if (!t.srb) {
-            QRhiSampler *sampler = t.filter == QRhiSampler::Nearest ? m_nearestSampler.get() : m_linearSampler.get();
+            QRhiSampler *sampler = m_shared->sampler(m_rhi, t.sampler);
+            if (!sampler)
+                return;
             t.srb = m_rhi->newShaderResourceBindings();
             t.srb->setBindings({
                 QRhiShaderResourceBinding::uniformBuffer(0, QRhiShaderResourceBinding::VertexStage | QRhiShaderResourceBinding::FragmentStage, m_ubuf.get()),
@@ -155,137 +934,444 @@ void QRhiImguiRenderer::prepare(QRhi *rhi,
         }
     }
 
-    // If layer.enabled is toggled on the item or an ancestor, the render
-    // target is then suddenly different and may not be compatible.
-    if (m_ps && m_rt->renderPassDescriptor()->serializedFormat() != m_renderPassFormat)
-        m_ps.reset();
-
-    if (m_ps && m_rt->sampleCount() != m_ps->sampleCount())
-        m_ps.reset();
-
-    if (!m_ps) {
-        QShader vs = getShader(QLatin1String(":/imgui.vert.qsb"));
-        QShader fs = getShader(QLatin1String(":/imgui.frag.qsb"));
-        if (!vs.isValid() || !fs.isValid()) {
-            qWarning("Failed to load imgui shaders");
+    if (needsPlaceholder && !m_placeholder.srb) {
+        m_placeholder.tex = m_rhi->newTexture(QRhiTexture::RGBA8, QSize(1, 1));
+        m_placeholder.tex->setName(QByteArrayLiteral("imgui image placeholder"));
+        if (!m_placeholder.tex->create())
             return;
-        }
-
-        m_ps.reset(m_rhi->newGraphicsPipeline());
-        QRhiGraphicsPipeline::TargetBlend blend;
-        blend.enable = true;
-        // Premultiplied alpha (matches imgui.frag). Would not be needed if we
-        // only cared about outputting to the window (the common case), but
-        // once going through a texture (Item layer, ShaderEffect) which is
-        // then sampled by Quick, the result wouldn't be correct otherwise.
-        blend.srcColor = QRhiGraphicsPipeline::One;
-        blend.dstColor = QRhiGraphicsPipeline::OneMinusSrcAlpha;
-        blend.srcAlpha = QRhiGraphicsPipeline::One;
-        blend.dstAlpha = QRhiGraphicsPipeline::OneMinusSrcAlpha;
-        m_ps->setTargetBlends({ blend });
-        m_ps->setCullMode(QRhiGraphicsPipeline::None);
-        m_ps->setDepthTest(true);
-        m_ps->setDepthOp(QRhiGraphicsPipeline::LessOrEqual);
-        m_ps->setDepthWrite(false);
-        m_ps->setFlags(QRhiGraphicsPipeline::UsesScissor);
-
-        m_ps->setShaderStages({
-            { QRhiShaderStage::Vertex, vs },
-            { QRhiShaderStage::Fragment, fs }
-        });
-
-        QRhiVertexInputLayout inputLayout;
-        inputLayout.setBindings({
-            { 4 * sizeof(float) + sizeof(quint32) }
+        m_placeholder.srb = m_rhi->newShaderResourceBindings();
+        m_placeholder.srb->setBindings({
+            QRhiShaderResourceBinding::uniformBuffer(0, QRhiShaderResourceBinding::VertexStage | QRhiShaderResourceBinding::FragmentStage, m_ubuf.get()),
+            QRhiShaderResourceBinding::sampledTexture(1, QRhiShaderResourceBinding::FragmentStage, m_placeholder.tex, m_shared->sampler(m_rhi, QRhiSampler::Nearest))
         });
-        inputLayout.setAttributes({
-            { 0, 0, QRhiVertexInputAttribute::Float2, 0 },
-            { 0, 1, QRhiVertexInputAttribute::Float2, 2 * sizeof(float) },
-            { 0, 2, QRhiVertexInputAttribute::UNormByte4, 4 * sizeof(float) }
-        });
-        m_ps->setVertexInputLayout(inputLayout);
-        m_ps->setSampleCount(rt->sampleCount());
-        m_ps->setShaderResourceBindings(m_textures[0].srb);
-        m_ps->setRenderPassDescriptor(m_rt->renderPassDescriptor());
-        m_renderPassFormat = m_rt->renderPassDescriptor()->serializedFormat();
+        if (!m_placeholder.srb->create())
+            return;
+        m_placeholderDirty = true;
+    }
 
-        if (!m_ps->create())
+    // If layer.enabled is toggled on the item or an ancestor, the render
+    // target is then suddenly different and may not be compatible. Switching
+    // back and forth finds the earlier pipeline in the cache.
+    QRhiRenderPassDescriptor *rpDesc = m_rt->renderPassDescriptor();
+    bool needsPs[TextureKindCount] = { true };
+    for (auto it = m_textures.cbegin(), end = m_textures.cend(); it != end; ++it)
+        needsPs[it->kind] = true;
+    Pipelines ps = {};
+    for (int kind = 0; kind < TextureKindCount; ++kind) {
+        if (needsPs[kind])
+            ps[kind] = pipeline(rpDesc, m_rt->sampleCount(), f.compactVertices, TextureKind(kind));
+    }
+    usePipelines(ps);
+    for (int kind = 0; kind < TextureKindCount; ++kind) {
+        if (needsPs[kind] && !m_ps[kind])
             return;
     }
 
     QRhiResourceUpdateBatch *u = m_rhi->nextResourceUpdateBatch();
 
-    for (const CmdListBuffer &b : f.vbuf)
-        u->updateDynamicBuffer(m_vbuf.get(), b.offset, b.data.size(), b.data.constData());
-
-    for (const CmdListBuffer &b : f.ibuf)
-        u->updateDynamicBuffer(m_ibuf.get(), b.offset, b.data.size(), b.data.constData());
+    updateChangedRanges(u, m_vbuf.buf.get(), m_vbuf.regionOffset(), f.vbuf, f.vbufData,
+                        &m_vbuf.versions[m_vbuf.currentRegion], &m_vbuf.stats.uploadedBytes);
+    updateChangedRanges(u, m_ibuf.buf.get(), m_ibuf.regionOffset(), f.ibuf, f.ibufData,
+                        &m_ibuf.versions[m_ibuf.currentRegion], &m_ibuf.stats.uploadedBytes);
 
     u->updateDynamicBuffer(m_ubuf.get(), 0, 64, mvp.constData());
     u->updateDynamicBuffer(m_ubuf.get(), 64, 4, &opacity);
     u->updateDynamicBuffer(m_ubuf.get(), 68, 4, &hdrWhiteLevelMultiplierOrZeroForSDRsRGB);
 
-    for (int i = 0; i < texturesNeedUpdate.count(); ++i) {
-        Texture &t(m_textures[texturesNeedUpdate[i]]);
-        if (!t.image.isNull()) {
-            u->uploadTexture(t.tex, t.image);
-            t.image = QImage();
+    m_shared->uploadFontTextures(u);
+    for (const ImageUpload &upload : imageUploads) {
+        if (upload.file) {
+            QVarLengthArray<QRhiTextureUploadEntry, 16> entries;
+            for (int level = 0; level < upload.levelCount; ++level)
+                entries.append(QRhiTextureUploadEntry(0, level, QRhiTextureSubresourceUploadDescription(upload.file->levels.at(level))));
+            QRhiTextureUploadDescription desc;
+            desc.setEntries(entries.cbegin(), entries.cend());
+            u->uploadTexture(upload.tex, desc);
+            continue;
         }
+        QRhiTextureSubresourceUploadDescription desc(upload.image);
+        desc.setSourceTopLeft(upload.source.topLeft());
+        desc.setSourceSize(upload.source.size());
+        desc.setDestinationTopLeft(upload.destination);
+        u->uploadTexture(upload.tex, QRhiTextureUploadDescription(QRhiTextureUploadEntry(0, 0, desc)));
+    }
+    for (QRhiTexture *tex : mipmapsNeeded)
+        u->generateMips(tex);
+    if (m_placeholder.tex && m_placeholderDirty) {
+        QImage image(1, 1, QImage::Format_RGBA8888);
+        image.fill(m_imagePlaceholderColor);
+        u->uploadTexture(m_placeholder.tex, image);
+        m_placeholderDirty = false;
     }
 
     m_cb->resourceUpdate(u);
-}
-
-void QRhiImguiRenderer::render()
-{
-    if (!m_rhi || f.draw.isEmpty() || !m_ps)
-        return;
-
-    m_cb->setGraphicsPipeline(m_ps.get());
 
+    // With base vertex support the vertex buffer is bound once, and the draw
+    // lists' positions in it are passed to drawIndexed(). The index buffer is
+    // always bound once, with firstIndex used instead.
+    const bool baseVertex = m_rhi->isFeatureSupported(QRhi::BaseVertex);
+    const quint32 stride = vertexSize(f.compactVertices);
+    m_drawCalls.ibufOffset = m_ibuf.regionOffset();
     const QSize viewportSize = m_rt->pixelSize();
-    bool needsViewport = true;
-
+    QVarLengthArray<void *, 4> evictedInUse;
     for (const DrawCmd &c : f.draw) {
-        QRhiCommandBuffer::VertexInput vbufBinding(m_vbuf.get(), f.vbuf[c.cmdListBufferIdx].offset);
-        if (needsViewport) {
-            needsViewport = false;
-            m_cb->setViewport({ 0, 0, float(viewportSize.width()), float(viewportSize.height()) });
+        auto it = m_textures.find(c.textureId);
+        if (it == m_textures.end())
+            continue;
+        it->lastUsedFrame = m_frameCount;
+        if (it->evicted) {
+            it->evicted = false;
+            evictedInUse.append(it.key());
+        }
+        if (it->srb) {
+            m_drawCalls.ps.append(m_ps[it->kind]);
+            m_drawCalls.srb.append(it->srb);
+        } else {
+            m_drawCalls.ps.append(m_ps[ColorTexture]);
+            m_drawCalls.srb.append(m_placeholder.srb);
         }
-        const float sx1 = c.clipRect.x() + c.itemPixelOffset.x();
-        const float sy1 = c.clipRect.y() + c.itemPixelOffset.y();
-        const float sx2 = c.clipRect.z() + c.itemPixelOffset.x();
-        const float sy2 = c.clipRect.w() + c.itemPixelOffset.y();
+
+        const float sx1 = c.clipRect.x() + f.itemPixelOffset.x();
+        const float sy1 = c.clipRect.y() + f.itemPixelOffset.y();
+        const float sx2 = c.clipRect.z() + f.itemPixelOffset.x();
+        const float sy2 = c.clipRect.w() + f.itemPixelOffset.y();
         QPoint scissorPos = QPointF(sx1, viewportSize.height() - sy2).toPoint();
         QSize scissorSize = QSizeF(sx2 - sx1, sy2 - sy1).toSize();
         scissorPos.setX(qMax(0, scissorPos.x()));
         scissorPos.setY(qMax(0, scissorPos.y()));
         scissorSize.setWidth(qMin(viewportSize.width(), scissorSize.width()));
         scissorSize.setHeight(qMin(viewportSize.height(), scissorSize.height()));
-        m_cb->setScissor({ scissorPos.x(), scissorPos.y(), scissorSize.width(), scissorSize.height() });
-        m_cb->setShaderResources(m_textures[c.textureId].srb);
-        m_cb->setVertexInput(0, 1, &vbufBinding, m_ibuf.get(), c.indexOffset, QRhiCommandBuffer::IndexUInt32);
-        m_cb->drawIndexed(c.elemCount);
+        m_drawCalls.scissor.append({ scissorPos.x(), scissorPos.y(), scissorSize.width(), scissorSize.height() });
+
+        // base vertex values are relative to the region, which does not
+        // necessarily start at a multiple of the vertex size
+        const quint32 vbufOffset = f.vbuf[c.cmdListBufferIdx].offset + c.vertexOffset * stride;
+        m_drawCalls.vbufOffset.append(m_vbuf.regionOffset() + (baseVertex ? 0 : vbufOffset));
+        m_drawCalls.vertexOffset.append(baseVertex ? qint32(vbufOffset / stride) : 0);
+        m_drawCalls.firstIndex.append(c.indexOffset / sizeof(ImDrawIdx));
+        m_drawCalls.indexCount.append(c.elemCount);
+    }
+
+    // Textures not drawn in this frame may go. Evicted ones drawn again are
+    // shown with the placeholder until loaded again.
+    evictImageTextures();
+    for (void *id : evictedInUse) {
+        const Texture t = m_textures.value(id);
+        startImageLoad(id, t.loadSize, t.sampler, t.load);
+    }
+}
+
+// Only complete textures of registered images, least recently drawn first.
+void QRhiImguiRenderer::evictImageTextures()
+{
+    const ResidencyPolicy &policy(m_residencyPolicy);
+    if (!policy.evictAfterFrames && !policy.budgetBytes)
+        return;
+    QVarLengthArray<QPair<quint64, void *>, 32> candidates; // last used frame, id
+    for (auto it = m_textures.cbegin(), end = m_textures.cend(); it != end; ++it) {
+        if (it->load && it->tex && !it->uploadPending() && it->lastUsedFrame != m_frameCount)
+            candidates.append({ it->lastUsedFrame, it.key() });
+    }
+    std::sort(candidates.begin(), candidates.end());
+    for (const QPair<quint64, void *> &c : candidates) {
+        const bool expired = policy.evictAfterFrames && m_frameCount - c.first > quint64(policy.evictAfterFrames);
+        const bool overBudget = policy.budgetBytes && m_residentImageBytes > policy.budgetBytes;
+        if (!expired && !overBudget)
+            break;
+        Texture &t(m_textures[c.second]);
+        releaseTexture(c.second, t);
+        t.tex = nullptr;
+        t.srb = nullptr;
+        t.uploadedRows = 0;
+        t.evicted = true;
+    }
+}
+
+void QRhiImguiRenderer::render()
+{
+    if (!m_rhi || m_drawCalls.indexCount.isEmpty() || !m_ps[ColorTexture])
+        return;
+
+    const QSize viewportSize = m_rt->pixelSize();
+
+    // Only issue state changes when something is actually different from the
+    // previous draw call. Switching pipelines (each TextureKind has its
+    // own) resets everything.
+    const DrawCalls &d(m_drawCalls);
+    for (int i = 0, count = d.indexCount.count(); i < count; ++i) {
+        const bool newPs = i == 0 || d.ps[i] != d.ps[i - 1];
+        if (newPs) {
+            m_cb->setGraphicsPipeline(d.ps[i]);
+            m_cb->setViewport({ 0, 0, float(viewportSize.width()), float(viewportSize.height()) });
+        }
+        if (newPs || d.vbufOffset[i] != d.vbufOffset[i - 1]) {
+            QRhiCommandBuffer::VertexInput vbufBinding(m_vbuf.buf.get(), d.vbufOffset[i]);
+            m_cb->setVertexInput(0, 1, &vbufBinding, m_ibuf.buf.get(), d.ibufOffset, INDEX_FORMAT);
+        }
+        if (newPs || d.scissor[i] != d.scissor[i - 1])
+            m_cb->setScissor(d.scissor[i]);
+        if (newPs || d.srb[i] != d.srb[i - 1])
+            m_cb->setShaderResources(d.srb[i]);
+        m_cb->drawIndexed(d.indexCount[i], 1, d.firstIndex[i], d.vertexOffset[i]);
     }
 }
 
 void QRhiImguiRenderer::registerCustomTexture(void *id,
                                               QRhiTexture *texture,
-                                              QRhiSampler::Filter filter,
-                                              CustomTextureOwnership ownership)
+                                              const SamplerDescription &sampler,
+                                              CustomTextureOwnership ownership,
+                                              TextureKind kind)
 {
     Q_ASSERT(id);
     auto it = m_textures.constFind(id);
-    if (it != m_textures.cend()) {
-        if (it->ownTex)
-            delete it->tex;
-        delete it->srb;
-    }
+    if (it != m_textures.cend())
+        releaseTexture(id, *it);
     Texture t;
     t.tex = texture;
-    t.filter = filter;
+    t.sampler = sampler;
     t.ownTex = ownership == TakeCustomTextureOwnership;
+    t.kind = kind;
+    m_textures[id] = t;
+}
+
+void QRhiImguiRenderer::unregisterCustomTexture(void *id)
+{
+    Q_ASSERT(id);
+    auto it = m_textures.find(id);
+    if (it == m_textures.end())
+        return;
+    releaseTexture(id, *it);
+    m_textures.erase(it);
+}
+
+// The QRhi keeps resources released with deleteLater() until the frames
+// that may still use them are done.
+void QRhiImguiRenderer::releaseTexture(void *id, const Texture &t, ReleaseMode mode)
+{
+    if (t.tex && t.ownTex) {
+        if (t.load)
+            m_residentImageBytes -= t.gpuSize;
+        if (mode == ReleaseNow)
+            delete t.tex;
+        else
+            t.tex->deleteLater();
+    }
+    if (t.srb) {
+        if (mode == ReleaseNow)
+            delete t.srb;
+        else
+            t.srb->deleteLater();
+    }
+    if (QRhiImguiImageAtlasPage *page = t.atlasPage) {
+        if (m_imageAtlasPlacements.remove(id))
+            ++m_imageAtlasVersion;
+        if (--page->images == 0)
+            stbrp_init_target(&page->packer, page->size, page->size, page->nodes.data(), int(page->nodes.size()));
+    }
+}
+
+// Finds room for an image of size (plus the repeated edges) in a page with
+// the same sampler, adds a page when there is none.
+bool QRhiImguiRenderer::allocateInImageAtlas(Texture *t, const QSize &size)
+{
+    const int pageSize = m_imageAtlasPolicy.pageSize;
+    stbrp_rect r = {};
+    r.w = size.width() + 2;
+    r.h = size.height() + 2;
+    if (r.w > pageSize || r.h > pageSize)
+        return false;
+    for (size_t i = 0; i <= m_imageAtlasPages.size(); ++i) {
+        if (i == m_imageAtlasPages.size()) {
+            std::unique_ptr<QRhiImguiImageAtlasPage> page(new QRhiImguiImageAtlasPage);
+            page->size = pageSize;
+            page->sampler = t->sampler;
+            page->nodes.resize(size_t(pageSize));
+            stbrp_init_target(&page->packer, pageSize, pageSize, page->nodes.data(), pageSize);
+            m_imageAtlasPages.push_back(std::move(page));
+        }
+        QRhiImguiImageAtlasPage *page = m_imageAtlasPages[i].get();
+        if (page->sampler != t->sampler || page->size != pageSize)
+            continue;
+        stbrp_pack_rects(&page->packer, &r, 1);
+        if (r.was_packed) {
+            page->images += 1;
+            t->atlasPage = page;
+            t->atlasRect = QRect(r.x, r.y, r.w, r.h);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copies image into the middle of one 2 pixels larger, with the edges
+// repeated around it, so that linear filtering at the edges does not pick
+// up the neighbours in the atlas.
+static QImage extrudeEdges(const QImage &image)
+{
+    if (image.isNull())
+        return image;
+    const int w = image.width();
+    const int h = image.height();
+    QImage result(w + 2, h + 2, QImage::Format_RGBA8888);
+    for (int y = 0; y < h + 2; ++y) {
+        const quint32 *src = reinterpret_cast<const quint32 *>(image.constScanLine(qBound(0, y - 1, h - 1)));
+        quint32 *dst = reinterpret_cast<quint32 *>(result.scanLine(y));
+        dst[0] = src[0];
+        memcpy(dst + 1, src, size_t(w) * 4);
+        dst[w + 1] = src[w - 1];
+    }
+    return result;
+}
+
+// Finished conversions, taken by the renderer in prepare(). Shared with the
+// conversions still running, so that the renderer can go away before them.
+struct QRhiImguiImageLoads
+{
+    struct Result {
+        void *id;
+        quint64 serial;
+        QImage image;
+        std::shared_ptr<const QRhiImguiTextureFile> file;
+    };
+    QMutex mutex;
+    QVector<Result> results;
+};
+
+void QRhiImguiRenderer::startImageLoad(void *id, const QSize &size, const SamplerDescription &sampler,
+                                       ImageLoad load)
+{
+    Q_ASSERT(id);
+    auto it = m_textures.constFind(id);
+    if (it != m_textures.cend())
+        releaseTexture(id, *it);
+    Texture t;
+    t.sampler = sampler;
+    t.loadSerial = ++m_lastImageLoadSerial;
+    t.load = load;
+    t.loadSize = size;
+    const int maxSize = m_imageAtlasPolicy.maxImageSize;
+    if (m_imageAtlasPolicy.enabled && sampler.mipmapMode == QRhiSampler::None
+            && sampler.addressU == QRhiSampler::ClampToEdge && sampler.addressV == QRhiSampler::ClampToEdge
+            && !size.isEmpty() && size.width() <= maxSize && size.height() <= maxSize
+            && allocateInImageAtlas(&t, size))
+    {
+        load = [load] { return LoadedImage(extrudeEdges(load().image)); };
+    }
     m_textures[id] = t;
+    runImageLoad(id, t.loadSerial, load);
+}
+
+void QRhiImguiRenderer::runImageLoad(void *id, quint64 serial, ImageLoad load)
+{
+    if (!m_imageLoads)
+        m_imageLoads = std::make_shared<QRhiImguiImageLoads>();
+    std::shared_ptr<QRhiImguiImageLoads> loads = m_imageLoads;
+    QThreadPool::globalInstance()->start([loads, id, serial, load] {
+        const LoadedImage loaded = load();
+        QMutexLocker locker(&loads->mutex);
+        loads->results.append({ id, serial, loaded.image, loaded.file });
+    });
+}
+
+// Results for ids registered again (or released) since are dropped.
+void QRhiImguiRenderer::takeLoadedImages()
+{
+    if (!m_imageLoads)
+        return;
+    QVector<QRhiImguiImageLoads::Result> results;
+    {
+        QMutexLocker locker(&m_imageLoads->mutex);
+        results.swap(m_imageLoads->results);
+    }
+    for (const QRhiImguiImageLoads::Result &r : results) {
+        auto it = m_textures.find(r.id);
+        if (it == m_textures.end() || it->loadSerial != r.serial)
+            continue;
+        if (r.file && !m_rhi->isTextureFormatSupported(r.file->format)) {
+            if (r.file->isDecodable()) {
+                // still under the same serial
+                std::shared_ptr<const QRhiImguiTextureFile> file = r.file;
+                runImageLoad(r.id, r.serial, [file] { return LoadedImage(file->decode()); });
+                continue;
+            }
+            qWarning("Texture format %d of texture %p is not supported and cannot be decoded",
+                     int(r.file->format), r.id);
+            it->loadSerial = 0;
+            continue;
+        }
+        it->loadSerial = 0;
+        if (r.image.isNull() && !r.file) {
+            qWarning("Failed to load the image for texture %p", r.id);
+            continue;
+        }
+        it->image = r.image;
+        it->file = r.file;
+        m_imageUploadQueue.append(r.id);
+    }
+}
+
+bool QRhiImguiRenderer::hasPendingImageWork() const
+{
+    if (!m_imageUploadQueue.isEmpty())
+        return true;
+    for (const Texture &t : m_textures) {
+        if (t.loadSerial)
+            return true;
+    }
+    return false;
+}
+
+static inline QImage textureImage(const QImage &image)
+{
+    return image.convertToFormat(QImage::Format_RGBA8888);
+}
+
+void QRhiImguiRenderer::registerCustomImage(void *id, const QImage &image, const SamplerDescription &sampler)
+{
+    startImageLoad(id, image.size(), sampler, [image] { return textureImage(image); });
+}
+
+void QRhiImguiRenderer::registerCustomImage(void *id,
+                                            const QByteArray &pixels,
+                                            const QSize &size,
+                                            int bytesPerLine,
+                                            QImage::Format format,
+                                            const SamplerDescription &sampler)
+{
+    startImageLoad(id, size, sampler, [pixels, size, bytesPerLine, format] {
+        if (pixels.size() < qint64(bytesPerLine) * size.height())
+            return QImage();
+        const QImage wrapper(reinterpret_cast<const uchar *>(pixels.constData()),
+                             size.width(), size.height(), bytesPerLine, format);
+        // no conversion means no copy either
+        return wrapper.format() == QImage::Format_RGBA8888 ? wrapper.copy() : textureImage(wrapper);
+    });
+}
+
+void QRhiImguiRenderer::registerCustomImageFile(void *id, const QString &filename, const SamplerDescription &sampler)
+{
+    // the size is not known up front, so never in the image atlas
+    startImageLoad(id, QSize(), sampler, [filename] { return textureImage(QImage(filename)); });
+}
+
+void QRhiImguiRenderer::registerCompressedTextureFile(void *id, const QString &filename, const SamplerDescription &sampler)
+{
+    // whether the format is supported is only known in prepare(), so any
+    // decoding happens after that
+    startImageLoad(id, QSize(), sampler, [filename] {
+        auto file = std::make_shared<QRhiImguiTextureFile>();
+        if (!file->load(filename))
+            return LoadedImage();
+        return LoadedImage(std::shared_ptr<const QRhiImguiTextureFile>(std::move(file)));
+    });
+}
+
+void QRhiImguiRenderer::setImagePlaceholderColor(const QColor &color)
+{
+    if (m_imagePlaceholderColor == color)
+        return;
+    m_imagePlaceholderColor = color;
+    m_placeholderDirty = true;
 }
 
 static const char *getClipboardText(void *)
@@ -301,59 +1387,210 @@ static void setClipboardText(void *, const char *text)
 }
 
 QRhiImgui::QRhiImgui()
+    : fontAtlas(std::make_shared<QRhiImguiFontAtlas>())
 {
-    context = ImGui::CreateContext();
+    context = ImGui::CreateContext(&fontAtlas->atlas);
     ImGui::SetCurrentContext(static_cast<ImGuiContext *>(context));
     rebuildFontAtlas();
     ImGuiIO &io(ImGui::GetIO());
     io.GetClipboardTextFn = getClipboardText;
     io.SetClipboardTextFn = setClipboardText;
+    io.BackendFlags |= ImGuiBackendFlags_RendererHasVtxOffset;
 }
 
 QRhiImgui::~QRhiImgui()
 {
+    fontAtlas->releaseGlyphCacheUser(this);
+    // before the atlas, which may go away with fontAtlas
     ImGui::DestroyContext(static_cast<ImGuiContext *>(context));
 }
 
-void QRhiImgui::rebuildFontAtlas()
+void QRhiImgui::shareFontAtlas(QRhiImgui *other)
 {
+    if (!other || other->fontAtlas == fontAtlas)
+        return;
     ImGui::SetCurrentContext(static_cast<ImGuiContext *>(context));
     ImGuiIO &io(ImGui::GetIO());
-    unsigned char *pixels;
-    int w, h;
-    io.Fonts->GetTexDataAsRGBA32(&pixels, &w, &h);
-    const QImage wrapperImg(const_cast<const uchar *>(pixels), w, h, QImage::Format_RGBA8888);
-    sf.fontTextureData = wrapperImg.copy();
-    io.Fonts->SetTexID(nullptr);
+    // the fonts of the old atlas are not referenced after the next NewFrame()
+    io.Fonts = &other->fontAtlas->atlas;
+    io.FontDefault = nullptr;
+    fontAtlas->releaseGlyphCacheUser(this);
+    fontAtlas = other->fontAtlas;
+}
+
+void QRhiImgui::rebuildFontAtlas()
+{
+    ImGui::SetCurrentContext(static_cast<ImGuiContext *>(context));
+    fontAtlas->build();
+}
+
+bool QRhiImgui::singleChannelFontAtlas() const
+{
+    return fontAtlas->singleChannel;
+}
+
+void QRhiImgui::setSingleChannelFontAtlas(bool enable)
+{
+    if (fontAtlas->singleChannel == enable)
+        return;
+    fontAtlas->singleChannel = enable;
+    rebuildFontAtlas();
+}
+
+QString QRhiImgui::fontAtlasCacheDirectory() const
+{
+    return fontAtlas->cacheDirectory;
+}
+
+void QRhiImgui::setFontAtlasCacheDirectory(const QString &path)
+{
+    fontAtlas->cacheDirectory = path;
+}
+
+bool QRhiImgui::distanceFieldFonts() const
+{
+    return fontAtlas->distanceField;
+}
+
+void QRhiImgui::setDistanceFieldFonts(bool enable)
+{
+    if (fontAtlas->distanceField == enable)
+        return;
+    fontAtlas->setDistanceField(enable);
+    rebuildFontAtlas();
 }
 
 void QRhiImgui::rebuildFontAtlasWithFont(const QString &filename)
 {
-    QFile f(filename);
-    if (!f.open(QIODevice::ReadOnly)) {
+    std::unique_ptr<QFile> f(new QFile(filename));
+    if (!f->open(QIODevice::ReadOnly)) {
         qWarning("Failed to open %s", qPrintable(filename));
         return;
     }
-    QByteArray font = f.readAll();
     ImGui::SetCurrentContext(static_cast<ImGuiContext *>(context));
     ImFontConfig fontCfg;
     fontCfg.FontDataOwnedByAtlas = false;
-    ImGui::GetIO().Fonts->Clear();
-    ImGui::GetIO().Fonts->AddFontFromMemoryTTF(font.data(), font.size(), 20.0f, &fontCfg);
+    fontAtlas->clearFonts();
+    // mapped, stays until the fonts are cleared
+    const QByteArray font = fontAtlas->addFontFile(std::move(f));
+    ImGui::GetIO().Fonts->AddFontFromMemoryTTF(const_cast<char *>(font.constData()), font.size(), 20.0f, &fontCfg);
+    rebuildFontAtlas();
+}
+
+void QRhiImgui::addGlyphs(const QString &text)
+{
+    ImGui::SetCurrentContext(static_cast<ImGuiContext *>(context));
+    fontAtlas->addGlyphs(text);
+}
+
+int QRhiImgui::addFontAtlasImage(const QImage &image)
+{
+    ImGui::SetCurrentContext(static_cast<ImGuiContext *>(context));
+    return fontAtlas->addImage(image);
+}
+
+void QRhiImgui::setGlyphCache(const ImWchar *ranges, int pageCount)
+{
+    fontAtlas->setGlyphCache(ranges, pageCount);
     rebuildFontAtlas();
 }
 
+quint32 QRhiImgui::RangeAllocator::allocate(quint32 size)
+{
+    for (int i = 0; i < freeList.count(); ++i) {
+        QPair<quint32, quint32> &r(freeList[i]);
+        if (r.second >= size) {
+            const quint32 offset = r.first;
+            r.first += size;
+            r.second -= size;
+            if (!r.second)
+                freeList.remove(i);
+            return offset;
+        }
+    }
+    const quint32 offset = end;
+    end += size;
+    return offset;
+}
+
+void QRhiImgui::RangeAllocator::release(quint32 offset, quint32 size)
+{
+    if (!size)
+        return;
+    int i = 0;
+    while (i < freeList.count() && freeList[i].first < offset)
+        ++i;
+    freeList.insert(i, { offset, size });
+    if (i + 1 < freeList.count() && freeList[i].first + freeList[i].second == freeList[i + 1].first) {
+        freeList[i].second += freeList[i + 1].second;
+        freeList.remove(i + 1);
+    }
+    if (i > 0 && freeList[i - 1].first + freeList[i - 1].second == freeList[i].first) {
+        freeList[i - 1].second += freeList[i].second;
+        freeList.remove(i);
+        --i;
+    }
+    if (freeList[i].first + freeList[i].second == end) {
+        end = freeList[i].first;
+        freeList.remove(i);
+    }
+}
+
+// Draws with images in the renderer's image atlas get the page as their
+// texture, and their texture coordinates mapped into the image's rect. Only
+// the vertices the indices refer to: after ImDrawListSplitter::Merge() the
+// channels share the vertex buffer, so other commands' vertices can be in
+// between. Coordinates outside [0, 1] would reach the neighbours in the
+// page, so they are clamped to the image's rect first. That is exact for
+// vertices at the image's edges, and otherwise still shows only the image.
+static void mapImageAtlasDraws(ImDrawData *draw, const QHash<void *, QRhiImguiRenderer::ImageAtlasPlacement> &placements)
+{
+    QBitArray mapped;
+    for (int n = 0; n < draw->CmdListsCount; ++n) {
+        ImDrawList *cmdList = draw->CmdLists[n];
+        mapped.clear();
+        for (ImDrawCmd &cmd : cmdList->CmdBuffer) {
+            if (cmd.UserCallback || !cmd.ElemCount)
+                continue;
+            auto it = placements.constFind(cmd.TextureId);
+            if (it == placements.cend())
+                continue;
+            cmd.TextureId = it->page;
+            if (mapped.isEmpty())
+                mapped.resize(cmdList->VtxBuffer.Size);
+            const ImVec2 scale(it->uv1.x - it->uv0.x, it->uv1.y - it->uv0.y);
+            const ImDrawIdx *idx = cmdList->IdxBuffer.Data + cmd.IdxOffset;
+            for (quint32 i = 0; i < cmd.ElemCount; ++i) {
+                const int vertex = int(cmd.VtxOffset + idx[i]);
+                if (mapped.testBit(vertex))
+                    continue;
+                mapped.setBit(vertex);
+                ImDrawVert &v(cmdList->VtxBuffer.Data[vertex]);
+                v.uv.x = it->uv0.x + qBound(0.0f, v.uv.x, 1.0f) * scale.x;
+                v.uv.y = it->uv0.y + qBound(0.0f, v.uv.y, 1.0f) * scale.y;
+            }
+        }
+    }
+}
+
 void QRhiImgui::nextFrame(const QSizeF &logicalOutputSize, float dpr, const QPointF &logicalOffset, FrameFunc frameFunc)
 {
     ImGui::SetCurrentContext(static_cast<ImGuiContext *>(context));
     ImGuiIO &io(ImGui::GetIO());
 
     const QPointF itemPixelOffset = logicalOffset * dpr;
+    f.itemPixelOffset = itemPixelOffset;
     f.outputPixelSize = (logicalOutputSize * dpr).toSize();
     io.DisplaySize.x = logicalOutputSize.width();
     io.DisplaySize.y = logicalOutputSize.height();
     io.DisplayFramebufferScale = ImVec2(dpr, dpr);
 
+    // Frames are not necessarily regular (e.g. QRhiImguiItem::renderOnDemand),
+    // so do not rely on the 1/60 default for timers, caret blinking, etc.
+    if (frameTimer.isValid())
+        io.DeltaTime = qMax(1e-6f, frameTimer.nsecsElapsed() / 1000000000.0f);
+    frameTimer.start();
+
     ImGui::NewFrame();
     if (frameFunc)
         frameFunc();
@@ -361,27 +1598,148 @@ void QRhiImgui::nextFrame(const QSizeF &logicalOutputSize, float dpr, const QPoi
 
     ImDrawData *draw = ImGui::GetDrawData();
     draw->ScaleClipRects(ImVec2(dpr, dpr));
+    if (!imageAtlas.isEmpty())
+        mapImageAtlasDraws(draw, imageAtlas);
+
+    ++frameIndex;
+
+    // Figure out where each draw list's data goes. Lists keep their ranges
+    // (keyed by the owner window) as long as they fit, and get a new version
+    // whenever their contents or their place changes.
+    //
+    // Glyphs not in the glyph cache are drawn as empty placeholders, these
+    // get cached for the next frame, in pages no list draws from. Lists
+    // with placeholders left are checked again until there is room. The
+    // scan replaces the placeholders' out of range texture coordinates
+    // before the vertices are looked at, so they do not cost the frame the
+    // compact vertex format.
+    const bool glyphCache = fontAtlas->hasGlyphCache();
+    QVector<QRhiImguiFontAtlas::GlyphRequest> missing;
+    quint64 glyphCachePages = 0;
+    QVarLengthArray<quint32, 64> keys(draw->CmdListsCount);
+    for (int n = 0; n < draw->CmdListsCount; ++n) {
+        ImDrawList *cmdList = draw->CmdLists[n];
+        const quint32 vtxCount = cmdList->VtxBuffer.Size;
+        const quint32 idxCount = cmdList->IdxBuffer.Size;
+        size_t hash = qHashBits(cmdList->IdxBuffer.Data, idxCount * sizeof(ImDrawIdx));
+        hash = qHashBits(cmdList->VtxBuffer.Data, vtxCount * sizeof(ImDrawVert), hash);
+        hash = qHashBits(cmdList->CmdBuffer.Data, cmdList->CmdBuffer.Size * sizeof(ImDrawCmd), hash);
+        quint32 key = cmdList->_OwnerName ? ImHashStr(cmdList->_OwnerName) : ImHashData(&cmdList, sizeof(cmdList));
+        auto it = cmdListAllocs.find(key);
+        while (it != cmdListAllocs.end() && it->lastUsedFrame == frameIndex)
+            it = cmdListAllocs.find(++key);
+        if (it == cmdListAllocs.end())
+            it = cmdListAllocs.insert(key, {});
+        keys[n] = key;
+        CmdListAllocation &a(*it);
+        a.lastUsedFrame = frameIndex;
+        const bool changed = !a.version || a.hash != hash || a.vtxCount != vtxCount || a.idxCount != idxCount;
+        if (glyphCache && (changed || a.scanGlyphCache)) {
+            const int missingBefore = missing.count();
+            a.glyphCachePages = fontAtlas->scanGlyphCache(cmdList, &missing);
+            a.scanGlyphCache = missing.count() > missingBefore;
+        }
+        glyphCachePages |= a.glyphCachePages;
+        if (!changed)
+            continue;
+        if (vtxCount > a.vtxCapacity) {
+            vtxAllocator.release(a.vtxOffset, a.vtxCapacity);
+            a.vtxCapacity = vtxCount + vtxCount / 4;
+            a.vtxOffset = vtxAllocator.allocate(a.vtxCapacity);
+        }
+        if (idxCount > a.idxCapacity) {
+            idxAllocator.release(a.idxOffset, a.idxCapacity);
+            // even, so that with 16-bit indices all ranges start at, and
+            // can be rounded up to, 4 byte boundaries
+            a.idxCapacity = (idxCount + idxCount / 4 + 1) & ~1u;
+            a.idxOffset = idxAllocator.allocate(a.idxCapacity);
+        }
+        a.vtxCount = vtxCount;
+        a.idxCount = idxCount;
+        a.hash = hash;
+        a.version = ++lastVersion;
+        a.compactable = compactVertices && fitsCompactVertexFormat(cmdList->VtxBuffer.Data, vtxCount);
+    }
+    glyphsCached = false;
+    if (glyphCache) {
+        fontAtlas->useGlyphCachePages(this, glyphCachePages);
+        if (!missing.isEmpty())
+            glyphsCached = fontAtlas->cacheGlyphs(std::move(missing));
+    }
+
+    quint32 liveVtx = 0;
+    quint32 liveIdx = 0;
+    bool compact = compactVertices && compactVerticesSupported;
+    for (auto it = cmdListAllocs.begin(); it != cmdListAllocs.end(); ) {
+        if (it->lastUsedFrame != frameIndex) {
+            vtxAllocator.release(it->vtxOffset, it->vtxCapacity);
+            idxAllocator.release(it->idxOffset, it->idxCapacity);
+            it = cmdListAllocs.erase(it);
+        } else {
+            liveVtx += it->vtxCapacity;
+            liveIdx += it->idxCapacity;
+            compact &= it->compactable;
+            ++it;
+        }
+    }
+
+    // The vertex format is per frame. When it changes, all vertex data has
+    // to be converted and uploaded again.
+    if (compact != lastFrameCompact) {
+        for (CmdListAllocation &a : cmdListAllocs)
+            a.version = ++lastVersion;
+        lastFrameCompact = compact;
+    }
+    const quint32 stride = vertexSize(compact);
+
+    // Start over with a compact layout when fragmentation gets out of hand.
+    // Everything gets uploaded again in this case.
+    static const quint32 COMPACT_SLACK = 16384;
+    if (vtxAllocator.end > 2 * liveVtx + COMPACT_SLACK || idxAllocator.end > 2 * liveIdx + COMPACT_SLACK) {
+        vtxAllocator.reset();
+        idxAllocator.reset();
+        for (int n = 0; n < draw->CmdListsCount; ++n) {
+            CmdListAllocation &a(cmdListAllocs[keys[n]]);
+            a.vtxOffset = vtxAllocator.allocate(a.vtxCapacity);
+            a.idxOffset = idxAllocator.allocate(a.idxCapacity);
+            a.version = ++lastVersion;
+        }
+    }
+
+    // Versions already present in f's data from the last time this storage was used.
+    QVarLengthArray<quint64, 64> storedVersions;
+    for (const QRhiImguiRenderer::CmdListBuffer &b : f.vbuf)
+        storedVersions.append(b.version);
+    std::sort(storedVersions.begin(), storedVersions.end());
 
     f.vbuf.resize(draw->CmdListsCount);
     f.ibuf.resize(draw->CmdListsCount);
-    f.totalVbufSize = 0;
-    f.totalIbufSize = 0;
+    f.compactVertices = compact;
+    f.totalVbufSize = vtxAllocator.end * stride;
+    f.totalIbufSize = idxAllocator.end * sizeof(ImDrawIdx);
+    // The arrays are the ones handed back by the renderer in the previous
+    // syncRenderer(), so in the steady state resize() does not allocate.
+    f.vbufData.resize(f.totalVbufSize);
+    f.ibufData.resize(f.totalIbufSize);
     for (int n = 0; n < draw->CmdListsCount; ++n) {
         const ImDrawList *cmdList = draw->CmdLists[n];
-        const int vbufSize = cmdList->VtxBuffer.Size * sizeof(ImDrawVert);
-        f.vbuf[n].offset = f.totalVbufSize;
-        f.totalVbufSize += vbufSize;
-        const int ibufSize = cmdList->IdxBuffer.Size * sizeof(ImDrawIdx);
-        f.ibuf[n].offset = f.totalIbufSize;
-        f.totalIbufSize += ibufSize;
+        const CmdListAllocation &a(*cmdListAllocs.constFind(keys[n]));
+        f.vbuf[n] = { a.vtxOffset * stride, a.vtxCount * stride, a.version };
+        f.ibuf[n] = { quint32(a.idxOffset * sizeof(ImDrawIdx)), quint32(a.idxCount * sizeof(ImDrawIdx)), a.version };
+        if (!std::binary_search(storedVersions.cbegin(), storedVersions.cend(), a.version)) {
+            if (compact) {
+                convertToCompactVertexFormat(reinterpret_cast<CompactVertex *>(f.vbufData.data() + f.vbuf[n].offset),
+                                             cmdList->VtxBuffer.Data, cmdList->VtxBuffer.Size);
+            } else {
+                memcpy(f.vbufData.data() + f.vbuf[n].offset, cmdList->VtxBuffer.Data, f.vbuf[n].size);
+            }
+            memcpy(f.ibufData.data() + f.ibuf[n].offset, cmdList->IdxBuffer.Data, f.ibuf[n].size);
+        }
     }
+
     f.draw.clear();
     for (int n = 0; n < draw->CmdListsCount; ++n) {
         const ImDrawList *cmdList = draw->CmdLists[n];
-        f.vbuf[n].data = QByteArray(reinterpret_cast<const char *>(cmdList->VtxBuffer.Data),
-                                    cmdList->VtxBuffer.Size * sizeof(ImDrawVert));
-        f.ibuf[n].data = QByteArray(reinterpret_cast<const char *>(cmdList->IdxBuffer.Data),
-                                    cmdList->IdxBuffer.Size * sizeof(ImDrawIdx));
         const ImDrawIdx *indexBufOffset = nullptr;
         for (int i = 0; i < cmdList->CmdBuffer.Size; ++i) {
             const ImDrawCmd *cmd = &cmdList->CmdBuffer[i];
@@ -390,26 +1748,151 @@ void QRhiImgui::nextFrame(const QSizeF &logicalOutputSize, float dpr, const QPoi
                 QRhiImguiRenderer::DrawCmd dc;
                 dc.cmdListBufferIdx = n;
                 dc.textureId = cmd->TextureId;
+                dc.vertexOffset = cmd->VtxOffset;
                 dc.indexOffset = indexOffset;
                 dc.elemCount = cmd->ElemCount;
-                dc.itemPixelOffset = itemPixelOffset;
                 dc.clipRect = QVector4D(cmd->ClipRect.x, cmd->ClipRect.y, cmd->ClipRect.z, cmd->ClipRect.w);
-                f.draw.append(dc);
+                // ImGui never leaves mergeable commands next to each other,
+                // but with mapImageAtlasDraws() images in the same atlas page
+                // end up with the same texture
+                QRhiImguiRenderer::DrawCmd *prev = f.draw.isEmpty() ? nullptr : &f.draw.last();
+                if (prev && prev->cmdListBufferIdx == n
+                        && prev->vertexOffset == dc.vertexOffset
+                        && prev->textureId == dc.textureId
+                        && prev->clipRect == dc.clipRect
+                        && prev->indexOffset + prev->elemCount * sizeof(ImDrawIdx) == dc.indexOffset)
+                {
+                    prev->elemCount += dc.elemCount;
+                } else {
+                    f.draw.append(dc);
+                }
             } else {
                 cmd->UserCallback(cmdList, cmd);
             }
             indexBufOffset += cmd->ElemCount;
         }
     }
+
+    size_t frameHash = qHash(itemPixelOffset.x(), qHash(itemPixelOffset.y()));
+    frameHash = qHash(f.outputPixelSize.width(), qHash(f.outputPixelSize.height(), frameHash));
+    for (const QRhiImguiRenderer::CmdListBuffer &b : f.vbuf)
+        frameHash = qHash(b.version, frameHash);
+    frameChanged = frameHash != lastFrameHash;
+    lastFrameHash = frameHash;
+
+    hasNewFrame = true;
+}
+
+bool QRhiImgui::lastFrameChanged() const
+{
+    return frameChanged;
+}
+
+int QRhiImgui::nextFrameDelay() const
+{
+    const ImGuiContext &g(*static_cast<ImGuiContext *>(context));
+
+    // the placeholders in the last frame can now be replaced
+    if (glyphsCached)
+        return 0;
+
+    for (bool down : g.IO.MouseDown) {
+        if (down)
+            return 0;
+    }
+
+    // window moves, ctrl+tab, fading modal backgrounds
+    if (g.MovingWindow || g.NavWindowingTarget || g.NavWindowingTargetAnim
+            || (g.DimBgRatio > 0.0f && g.DimBgRatio < 1.0f))
+    {
+        return 0;
+    }
+
+    float delay = -1.0f;
+    auto wakeAfter = [&delay](float t) {
+        if (delay < 0.0f || t < delay)
+            delay = t;
+    };
+
+    if (g.ActiveId) {
+        if (g.InputTextState.ID != g.ActiveId)
+            return 0;
+        if (g.IO.ConfigInputTextCursorBlink) {
+            // matches InputTextEx(): visible for 0.8 s, then hidden for 0.4 s
+            const float anim = g.InputTextState.CursorAnim;
+            if (anim <= 0.0f) {
+                wakeAfter(0.8f - anim);
+            } else {
+                const float t = ImFmod(anim, 1.2f);
+                wakeAfter(t <= 0.8f ? 0.8f - t : 1.2f - t);
+            }
+        }
+    }
+
+    // Hover delays are based on HoveredIdTimer and HoveredIdNotActiveTimer,
+    // which only advance when there are frames: the resize feedback of
+    // window borders and table columns, the slow tooltips of clipped tabs
+    // and table headers, and the tab expand animation (see TabItemEx()).
+    if (g.HoveredId) {
+        static const float resizeFeedbackDelays[] = { 0.04f, 0.06f };
+        for (float d : resizeFeedbackDelays) {
+            if (g.HoveredIdTimer < d) {
+                wakeAfter(d - g.HoveredIdTimer);
+                break;
+            }
+        }
+        static const float TAB_EXPAND_START = 0.40f;
+        static const float TAB_EXPAND_DURATION = 1.0f / 6.0f;
+        const float notActive = g.HoveredIdNotActiveTimer;
+        if (notActive >= TAB_EXPAND_START && notActive < TAB_EXPAND_START + TAB_EXPAND_DURATION)
+            return 0;
+        if (notActive < TAB_EXPAND_START)
+            wakeAfter(TAB_EXPAND_START - notActive);
+        if (notActive < g.TooltipSlowDelay)
+            wakeAfter(g.TooltipSlowDelay - notActive);
+    }
+
+    return delay < 0.0f ? -1 : qMax(1, qCeil(delay * 1000.0f));
 }
 
 void QRhiImgui::syncRenderer(QRhiImguiRenderer *renderer)
 {
-    if (sf.isValid()) {
-        renderer->sf = sf;
-        sf.reset();
+    // Also when the renderer lost its resources (e.g. due to a new QRhi)
+    // since the last time.
+    if (renderer->fontAtlasGeneration() != fontAtlas->generation) {
+        renderer->sf.fontTextureData = fontAtlas->image;
+        renderer->sf.fontAtlasGeneration = fontAtlas->generation;
+        renderer->sf.fontAtlasBaseGeneration = fontAtlas->baseGeneration;
+        renderer->sf.fontAtlasUpdates = fontAtlas->updates;
+        renderer->sf.fontAtlasDistanceField = fontAtlas->distanceField;
+    }
+    imageWorkPending = renderer->hasPendingImageWork();
+    if (renderer->imageAtlasVersion() != imageAtlasVersion) {
+        imageAtlas = renderer->imageAtlasPlacements();
+        imageAtlasVersion = renderer->imageAtlasVersion();
+        imageWorkPending = true;
     }
-    renderer->f = std::move(f);
+    // Double buffering: the renderer gets the new frame, while we take over
+    // the storage of its previous one (which it is done with by now, since
+    // sync and prepare/render are never interleaved), and reuse that in the
+    // next nextFrame(). If there was no nextFrame() since the last sync, the
+    // renderer keeps what it has.
+    if (hasNewFrame) {
+        std::swap(renderer->f, f);
+        hasNewFrame = false;
+    }
+    compactVerticesSupported = renderer->isCompactVertexFormatSupported();
+}
+
+void QRhiImgui::setCompactVertexFormat(bool enable)
+{
+    if (compactVertices == enable)
+        return;
+    compactVertices = enable;
+    // whether the lists fit is only checked while enabled, so start over
+    vtxAllocator.reset();
+    idxAllocator.reset();
+    cmdListAllocs.clear();
 }
 
 static void updateKeyboardModifiers(Qt::KeyboardModifiers modifiers)
@@ -25,9 +25,19 @@
 #endif
 #endif
 
+#include <QtCore/qelapsedtimer.h>
+#include <array>
+
+#include "imgui.h"
+
 QT_BEGIN_NAMESPACE
 
 class QEvent;
+class QRhiImguiSharedResources;
+struct QRhiImguiImageLoads;
+struct QRhiImguiImageAtlasPage;
+struct QRhiImguiTextureFile;
+struct QRhiImguiFontAtlas;
 
 class QRhiImguiRenderer
 {
@@ -36,31 +46,64 @@ public:
 
     struct CmdListBuffer {
         quint32 offset;
-        QByteArray data;
+        quint32 size;
+        // identifies both the contents and the placement of the range, a
+        // range with a version that is already in the buffer needs no upload
+        quint64 version;
     };
 
     struct DrawCmd {
         int cmdListBufferIdx;
         void *textureId;
+        quint32 vertexOffset; // in vertices, relative to the CmdListBuffer
         quint32 indexOffset;
         quint32 elemCount;
-        QPointF itemPixelOffset;
         QVector4D clipRect;
     };
 
+    // A part of the font atlas that changed since its last full build.
+    struct FontAtlasUpdate {
+        quint64 generation;
+        QRect rect;
+    };
+
     struct StaticRenderData {
         QImage fontTextureData;
+        quint64 fontAtlasGeneration = 0;
+        // A texture with the base generation or newer only needs the rects of
+        // the updates newer than it uploaded.
+        quint64 fontAtlasBaseGeneration = 0;
+        QVector<FontAtlasUpdate> fontAtlasUpdates;
+        bool fontAtlasDistanceField = false;
         bool isValid() const { return !fontTextureData.isNull(); }
-        void reset() { fontTextureData = QImage(); }
+        void reset() {
+            fontTextureData = QImage();
+            fontAtlasGeneration = 0;
+            fontAtlasBaseGeneration = 0;
+            fontAtlasUpdates.clear();
+            fontAtlasDistanceField = false;
+        }
     };
 
     struct FrameRenderData {
         quint32 totalVbufSize = 0;
         quint32 totalIbufSize = 0;
+        // all vertex and index data for the frame, the CmdListBuffers refer
+        // to ranges in these, laid out the same way as in the QRhiBuffers.
+        // Changed ranges get copied twice: from ImGui into these in
+        // QRhiImgui::nextFrame(), then by prepare() into the buffers. Copying
+        // straight into mapped buffers is not possible, nextFrame() runs on
+        // the GUI thread, and QRhi buffers can only be mapped on the render
+        // thread.
+        QByteArray vbufData;
+        QByteArray ibufData;
         QVarLengthArray<CmdListBuffer, 4> vbuf;
         QVarLengthArray<CmdListBuffer, 4> ibuf;
         QVarLengthArray<DrawCmd, 4> draw;
+        QPointF itemPixelOffset;
         QSize outputPixelSize;
+        // vertex data is in the compact format, see QRhiImgui::setCompactVertexFormat()
+        bool compactVertices = false;
     };
 
     StaticRenderData sf;
@@ -75,36 +118,302 @@ public:
     void render();
     void releaseResources();
 
+    // Creates the pipeline for rendering into render targets compatible with
+    // rpDesc, so that the first prepare() with such a target does not have
+    // to. Pipelines for a few different targets are kept around.
+    void prewarm(QRhi *rhi, QRhiRenderPassDescriptor *rpDesc, int sampleCount, bool compactVertices = false);
+
     enum CustomTextureOwnership {
         TakeCustomTextureOwnership,
         NoCustomTextureOwnership
     };
+    // What the fragment shader takes from the texture. Each has its own
+    // pipeline.
+    enum TextureKind {
+        ColorTexture,
+        AlphaTexture, // R8 with coverage only
+        DistanceFieldTexture, // R8, or alpha with white, 0.5 is the edge
+        TextureKindCount
+    };
+    // How a texture is sampled. A plain filter converts to one with that
+    // filter for both minification and magnification, no mipmaps and
+    // repeating coordinates. Samplers are shared for equal descriptions.
+    // There is no anisotropic filtering, QRhiSampler does not offer it.
+    struct SamplerDescription {
+        SamplerDescription() = default;
+        SamplerDescription(QRhiSampler::Filter filter) : magFilter(filter), minFilter(filter) { }
+        QRhiSampler::Filter magFilter = QRhiSampler::Linear;
+        QRhiSampler::Filter minFilter = QRhiSampler::Linear;
+        // mipmapped images get their mip levels generated after the upload
+        QRhiSampler::Filter mipmapMode = QRhiSampler::None;
+        QRhiSampler::AddressMode addressU = QRhiSampler::Repeat;
+        QRhiSampler::AddressMode addressV = QRhiSampler::Repeat;
+        bool operator==(const SamplerDescription &other) const {
+            return magFilter == other.magFilter && minFilter == other.minFilter && mipmapMode == other.mipmapMode
+                    && addressU == other.addressU && addressV == other.addressV;
+        }
+        bool operator!=(const SamplerDescription &other) const { return !(*this == other); }
+    };
+    // texture has to be mipmapped already when sampler uses mipmaps.
     void registerCustomTexture(void *id,
                                QRhiTexture *texture,
-                               QRhiSampler::Filter filter,
-                               CustomTextureOwnership ownership);
+                               const SamplerDescription &sampler,
+                               CustomTextureOwnership ownership,
+                               TextureKind kind = ColorTexture);
+    // Removes what id has. The texture (when owned) and its bindings are
+    // released once the frames in flight are done with them.
+    void unregisterCustomTexture(void *id);
+    // Registers image as the texture for id, replacing what id had. The
+    // conversion to RGBA happens on a worker thread, the upload in the
+    // following prepare() calls, within imageUploadBudget(). Until the upload
+    // completes, draws with id show imagePlaceholderColor().
+    void registerCustomImage(void *id,
+                             const QImage &image,
+                             const SamplerDescription &sampler = SamplerDescription());
+    // The same with raw pixels in one of the QImage formats. pixels is only
+    // referenced until the conversion.
+    void registerCustomImage(void *id,
+                             const QByteArray &pixels,
+                             const QSize &size,
+                             int bytesPerLine,
+                             QImage::Format format,
+                             const SamplerDescription &sampler = SamplerDescription());
+    // The same with an image file, which is read and decoded on the worker
+    // thread as well.
+    void registerCustomImageFile(void *id,
+                                 const QString &filename,
+                                 const SamplerDescription &sampler = SamplerDescription());
+    // The same with a KTX or KTX2 file, 2D and not supercompressed. The data
+    // (BC1-BC7, ETC2, ASTC or RGBA8) is uploaded as it is, with the mip
+    // levels in the file, when the QRhi supports the format. Otherwise BC1-BC5
+    // and ETC2 get decoded to RGBA on the worker thread and go the way of
+    // images, other formats fail.
+    void registerCompressedTextureFile(void *id,
+                                       const QString &filename,
+                                       const SamplerDescription &sampler = SamplerDescription());
+
+    // Bytes of registered images uploaded per prepare() at most, images
+    // larger than what is left go in parts of rows. 0 means no limit.
+    quint64 imageUploadBudget() const { return m_imageUploadBudget; }
+    void setImageUploadBudget(quint64 bytesPerFrame) { m_imageUploadBudget = bytesPerFrame; }
+    QColor imagePlaceholderColor() const { return m_imagePlaceholderColor; }
+    void setImagePlaceholderColor(const QColor &color);
+    // Whether registered images are still loading, or waiting for (the rest
+    // of) their upload. These need further prepare() calls to show up, also
+    // when the UI itself does not change.
+    bool hasPendingImageWork() const;
+
+    // The textures of images registered with registerCustomImage() (except
+    // the ones in the image atlas) can be released while not drawn, they are
+    // loaded again when drawn later, with the placeholder shown until then.
+    struct ResidencyPolicy {
+        // released after this many frames without being drawn, 0 for never
+        int evictAfterFrames = 0;
+        // the least recently drawn ones are released while all of them take
+        // more than this, 0 for no limit
+        quint64 budgetBytes = 0;
+    };
+    ResidencyPolicy residencyPolicy() const { return m_residencyPolicy; }
+    void setResidencyPolicy(const ResidencyPolicy &policy) { m_residencyPolicy = policy; }
+    // Bytes taken by the textures the policy applies to.
+    quint64 residentImageBytes() const { return m_residentImageBytes; }
+
+    // Images registered with registerCustomImage() that are no larger than
+    // maxImageSize go into shared pageSize x pageSize textures instead of
+    // their own. QRhiImgui maps the texture coordinates of their draws
+    // into the page, so windows with many of them (e.g. toolbars) need a
+    // single draw call instead of one per image. Only images sampled with
+    // ClampToEdge for both addressU and addressV and without mipmaps go
+    // there, as the others would pick up their neighbours in the page (the
+    // default sampler repeats). Applies to images registered afterwards.
+    struct ImageAtlasPolicy {
+        bool enabled = false;
+        int pageSize = 512;
+        int maxImageSize = 64;
+    };
+    ImageAtlasPolicy imageAtlasPolicy() const { return m_imageAtlasPolicy; }
+    void setImageAtlasPolicy(const ImageAtlasPolicy &policy) { m_imageAtlasPolicy = policy; }
+
+    // Where the uploaded images of the image atlas are, the page pointer is
+    // the texture id to draw with. Changes bump the version.
+    struct ImageAtlasPlacement {
+        void *page;
+        ImVec2 uv0;
+        ImVec2 uv1;
+    };
+    const QHash<void *, ImageAtlasPlacement> &imageAtlasPlacements() const { return m_imageAtlasPlacements; }
+    quint64 imageAtlasVersion() const { return m_imageAtlasVersion; }
+
+    struct BufferPolicy {
+        // Sizes are per frame in flight. Capacity is set to the required
+        // size times growthFactor when growing.
+        float growthFactor = 1.5f;
+        // buffers this size or smaller are never shrunk
+        quint32 highWaterMark = 1024 * 1024;
+        // shrink after this many consecutive frames of using less than
+        // 1 / (growthFactor * growthFactor) of the capacity
+        int shrinkDelayFrames = 300;
+    };
+    BufferPolicy bufferPolicy() const { return m_bufferPolicy; }
+    void setBufferPolicy(const BufferPolicy &policy) { m_bufferPolicy = policy; }
+
+    struct BufferStats {
+        quint32 grows = 0;
+        quint32 shrinks = 0;
+        quint64 uploadedBytes = 0;
+    };
+    BufferStats vertexBufferStats() const { return m_vbuf.stats; }
+    BufferStats indexBufferStats() const { return m_ibuf.stats; }
+
+    // The font atlas (see StaticRenderData) the renderer has a texture for,
+    // 0 if none.
+    quint64 fontAtlasGeneration() const { return m_fontAtlasGeneration; }
+
+    // Native pipeline cache data for the QRhi is loaded from the file before
+    // the first pipeline is created, and is written back in
+    // releaseResources(). The latter needs QRhi::EnablePipelineCacheDataSave.
+    // The cache is per QRhi, so leave this unset when something else manages
+    // it, e.g. Qt Quick with QQuickGraphicsConfiguration.
+    QString pipelineCacheFile() const { return m_pipelineCacheFile; }
+    void setPipelineCacheFile(const QString &filename) { m_pipelineCacheFile = filename; }
+
+    struct PipelineStats {
+        quint32 created = 0;
+        // time spent in creating the last pipeline, shader loading included
+        qint64 lastCreateNs = 0;
+        qint64 totalCreateNs = 0;
+        quint32 evicted = 0;
+        bool cacheLoaded = false;
+    };
+    PipelineStats pipelineStats() const { return m_pipelineStats; }
+
+    // Whether FrameRenderData with compactVertices set can be rendered. Known
+    // only after the first prepare(), always false with Qt older than 6.7.
+    bool isCompactVertexFormatSupported() const { return m_compactVertexFormatSupported; }
 
 private:
+    struct GeometryBuffer {
+        std::unique_ptr<QRhiBuffer> buf;
+        quint32 regionSize = 0;
+        int currentRegion = 0;
+        // sorted lists of CmdListBuffer versions present in each region
+        QVector<QVector<quint64>> versions;
+        quint32 peakSize = 0;
+        int quietFrames = 0;
+        BufferStats stats;
+        quint32 regionOffset() const { return currentRegion * regionSize; }
+    };
+    bool ensureBuffer(GeometryBuffer *b, QRhiBuffer::UsageFlag usage, quint32 size, const char *name);
+    void useRhi(QRhi *rhi);
+    bool ensureCommonResources();
+    using Pipelines = std::array<QRhiGraphicsPipeline *, TextureKindCount>;
+    QRhiGraphicsPipeline *pipeline(QRhiRenderPassDescriptor *rpDesc, int sampleCount,
+                                   bool compactVertices, TextureKind textureKind);
+    void usePipelines(const Pipelines &ps);
+    void loadPipelineCache();
+    void savePipelineCache();
+    // What a conversion gives: an image, or the contents of a texture file.
+    struct LoadedImage {
+        LoadedImage(const QImage &image = QImage()) : image(image) { }
+        LoadedImage(std::shared_ptr<const QRhiImguiTextureFile> file) : file(std::move(file)) { }
+        QImage image;
+        std::shared_ptr<const QRhiImguiTextureFile> file;
+    };
+    using ImageLoad = std::function<LoadedImage()>;
+    void startImageLoad(void *id, const QSize &size, const SamplerDescription &sampler, ImageLoad load);
+    void runImageLoad(void *id, quint64 serial, ImageLoad load);
+    void takeLoadedImages();
+    void evictImageTextures();
+
     QRhi *m_rhi = nullptr;
+    QRhiImguiSharedResources *m_shared = nullptr;
     QRhiRenderTarget *m_rt = nullptr;
     QRhiCommandBuffer *m_cb = nullptr;
 
-    std::unique_ptr<QRhiBuffer> m_vbuf;
-    std::unique_ptr<QRhiBuffer> m_ibuf;
+    BufferPolicy m_bufferPolicy;
+    GeometryBuffer m_vbuf;
+    GeometryBuffer m_ibuf;
+
+    // The draw calls for render(), built from f.draw in prepare(), with
+    // everything resolved so that render() only needs to compare and pass on
+    // values. One entry per draw call in each.
+    struct DrawCalls {
+        QVector<QRhiGraphicsPipeline *> ps;
+        QVector<QRhiShaderResourceBindings *> srb;
+        QVector<QRhiScissor> scissor;
+        QVector<quint32> vbufOffset;
+        QVector<qint32> vertexOffset;
+        QVector<quint32> firstIndex;
+        QVector<quint32> indexCount;
+        quint32 ibufOffset = 0;
+        void clear() {
+            ps.clear();
+            srb.clear();
+            scissor.clear();
+            vbufOffset.clear();
+            vertexOffset.clear();
+            firstIndex.clear();
+            indexCount.clear();
+        }
+    } m_drawCalls;
+
     std::unique_ptr<QRhiBuffer> m_ubuf;
-    std::unique_ptr<QRhiGraphicsPipeline> m_ps;
-    QVector<quint32> m_renderPassFormat;
-    std::unique_ptr<QRhiSampler> m_linearSampler;
-    std::unique_ptr<QRhiSampler> m_nearestSampler;
+    // the ones for the current frame, per TextureKind, owned by m_shared
+    Pipelines m_ps = {};
+    bool m_compactVertexFormatSupported = false;
+    QString m_pipelineCacheFile;
+    bool m_pipelineCacheChecked = false;
+    PipelineStats m_pipelineStats;
 
     struct Texture {
         QImage image;
+        // texture file data waiting for upload, instead of image
+        std::shared_ptr<const QRhiImguiTextureFile> file;
         QRhiTexture *tex = nullptr;
         QRhiShaderResourceBindings *srb = nullptr;
-        QRhiSampler::Filter filter = QRhiSampler::Linear;
+        SamplerDescription sampler;
         bool ownTex = true;
+        TextureKind kind = ColorTexture;
+        // the conversion the image comes from, 0 when not waiting for one
+        quint64 loadSerial = 0;
+        int uploadedRows = 0;
+        // set for images in the image atlas, these have no texture of their own
+        QRhiImguiImageAtlasPage *atlasPage = nullptr;
+        QRect atlasRect;
+        // for registered images, to load them again after an eviction
+        ImageLoad load;
+        QSize loadSize;
+        bool evicted = false;
+        quint64 gpuSize = 0;
+        quint64 lastUsedFrame = 0;
+        bool uploadPending() const { return !image.isNull() || file; }
+    };
+    enum ReleaseMode {
+        ReleaseNow,
+        ReleaseAfterFramesInFlight
     };
+    void releaseTexture(void *id, const Texture &t, ReleaseMode mode = ReleaseAfterFramesInFlight);
+    bool allocateInImageAtlas(Texture *t, const QSize &size);
     QHash<void *, Texture> m_textures;
+    quint64 m_fontAtlasGeneration = 0;
+    quint64 m_frameCount = 0;
+    ResidencyPolicy m_residencyPolicy;
+    quint64 m_residentImageBytes = 0;
+
+    // Registered images are drawn with the placeholder until they have
+    // their texture and srb.
+    std::shared_ptr<QRhiImguiImageLoads> m_imageLoads;
+    quint64 m_lastImageLoadSerial = 0;
+    QVector<void *> m_imageUploadQueue; // in the order the conversions finished
+    quint64 m_imageUploadBudget = 4 * 1024 * 1024;
+    QColor m_imagePlaceholderColor = QColor(128, 128, 128, 64);
+    bool m_placeholderDirty = true;
+    Texture m_placeholder;
+
+    ImageAtlasPolicy m_imageAtlasPolicy;
+    std::vector<std::unique_ptr<QRhiImguiImageAtlasPage>> m_imageAtlasPages;
+    QHash<void *, ImageAtlasPlacement> m_imageAtlasPlacements;
+    quint64 m_imageAtlasVersion = 0;
 };
 
 class QRhiImgui
@@ -120,11 +429,110 @@ public:
 
     void rebuildFontAtlas();
     void rebuildFontAtlasWithFont(const QString &filename);
+    // Makes this instance use the font atlas of other, instead of its own. The
+    // atlas is then built once, and the renderers of all instances sharing it
+    // use the same texture per QRhi. Rebuilding it from any of them affects
+    // all. Call between frames only.
+    void shareFontAtlas(QRhiImgui *other);
+    // Keeps the atlas as coverage only, in an R8 texture (where supported),
+    // instead of white RGBA pixels. A quarter of the memory, but custom rects
+    // with colors (e.g. icons) added to the atlas lose their colors.
+    bool singleChannelFontAtlas() const;
+    void setSingleChannelFontAtlas(bool enable);
+    // Bakes the glyphs as signed distance fields, drawn with a shader that
+    // keeps the edges sharp at any scale (io.FontGlobalScale, ImFont::Scale,
+    // the device pixel ratio), so one atlas serves all sizes. Best with the
+    // fonts added at a size larger than the usual one and scaled down. As
+    // with a single channel atlas, images in the atlas lose their colors,
+    // and their soft edges too.
+    bool distanceFieldFonts() const;
+    void setDistanceFieldFonts(bool enable);
+    // Where the results of atlas builds are stored, one file per distinct
+    // input (font data, sizes, glyph ranges, oversampling, ...). A build with
+    // the same input maps the file instead, and skips rasterization. Applies
+    // to the next build. Empty (the default) disables caching.
+    QString fontAtlasCacheDirectory() const;
+    void setFontAtlasCacheDirectory(const QString &path);
+    // Rasterizes the glyphs of text missing from the fonts into the unused
+    // part of the atlas, only that part is uploaded then. When there is no
+    // room left, the atlas is rebuilt with them. Call between frames only.
+    void addGlyphs(const QString &text);
+    // Adds image to the atlas in the same way. Returns the index of the
+    // custom rect (see ImFontAtlas::GetCustomRectByIndex()), -1 on failure.
+    int addFontAtlasImage(const QImage &image);
+    // Glyphs in ranges (e.g. ImFontAtlas::GetGlyphRangesChineseFull()) that
+    // the fonts do not have from the build get rasterized when first shown,
+    // instead of all up front. They go into pageCount (at most 64) pages of
+    // 256x256 in the atlas, the least recently used page not shown is reused
+    // when all are full. New glyphs show up in the frame after the one that
+    // needed them first, nextFrameDelay() asks for that. Rebuilds the atlas.
+    void setGlyphCache(const ImWchar *ranges, int pageCount = 8);
+
+    // Whether the last nextFrame() generated anything different than the one before it.
+    bool lastFrameChanged() const;
+    // Whether the renderer had images loading or uploading at the last
+    // syncRenderer(), or gave a new image atlas layout that the next
+    // nextFrame() has to remap the draws to.
+    bool hasPendingImageWork() const { return imageWorkPending; }
+    // Time in milliseconds after which ImGui wants a new frame even when
+    // there is no input (caret blinking, hover delays), 0 when it needs
+    // frames continuously, -1 when it does not need any.
+    int nextFrameDelay() const;
+
+    // Store vertices as 12 bytes (16-bit fixed point positions and texture
+    // coordinates) instead of 20 when the renderer supports it. Frames with
+    // positions or texture coordinates out of the representable range (e.g.
+    // windows far outside, images with repeating texture coordinates) fall
+    // back to the full format.
+    bool compactVertexFormat() const { return compactVertices; }
+    void setCompactVertexFormat(bool enable);
 
 private:
     void *context;
-    QRhiImguiRenderer::StaticRenderData sf;
+    std::shared_ptr<QRhiImguiFontAtlas> fontAtlas;
     QRhiImguiRenderer::FrameRenderData f;
+    bool hasNewFrame = false;
+    QElapsedTimer frameTimer;
+    size_t lastFrameHash = 0;
+    bool frameChanged = true;
+    bool compactVertices = false;
+    bool compactVerticesSupported = false;
+    bool lastFrameCompact = false;
+    bool glyphsCached = false;
+    // from the renderer, see QRhiImguiRenderer::setImageAtlasPolicy()
+    QHash<void *, QRhiImguiRenderer::ImageAtlasPlacement> imageAtlas;
+    quint64 imageAtlasVersion = 0;
+    bool imageWorkPending = false;
+
+    // Persistent placement of each draw list's data in the vertex and index
+    // buffers, so that the data of unchanged draw lists can stay where it is,
+    // both in the FrameRenderData and in the renderer's QRhiBuffers.
+    struct RangeAllocator {
+        quint32 allocate(quint32 size);
+        void release(quint32 offset, quint32 size);
+        void reset() { freeList.clear(); end = 0; }
+        QVarLengthArray<QPair<quint32, quint32>, 16> freeList; // offset, size, sorted by offset
+        quint32 end = 0;
+    };
+    struct CmdListAllocation {
+        quint32 vtxOffset = 0; // in vertices
+        quint32 vtxCapacity = 0;
+        quint32 vtxCount = 0;
+        quint32 idxOffset = 0; // in ImDrawIdxs
+        quint32 idxCapacity = 0;
+        quint32 idxCount = 0;
+        size_t hash = 0;
+        quint64 version = 0;
+        quint32 lastUsedFrame = 0;
+        bool compactable = false; // fits the compact vertex format
+        bool scanGlyphCache = true;
+        quint64 glyphCachePages = 0; // mask of the pages drawn from
+    };
+    RangeAllocator vtxAllocator;
+    RangeAllocator idxAllocator;
+    QHash<quint32, CmdListAllocation> cmdListAllocs; // keyed by the owner window's ID
+    quint32 frameIndex = 0;
+    quint64 lastVersion = 0;
     Qt::MouseButtons pressedMouseButtons;
 };
 
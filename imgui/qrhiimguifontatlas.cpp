@@ -0,0 +1,1295 @@
+// Copyright (C) 2022 The Qt Company Ltd.
+// SPDX-License-Identifier: LicenseRef-Qt-Commercial OR BSD-3-Clause
+
+#include "qrhiimguifontatlas_p.h"
+#include <QtCore/qatomic.h>
+#include <QtCore/qcryptographichash.h>
+#include <QtCore/qdir.h>
+#include <QtCore/qendian.h>
+#include <QtCore/qsavefile.h>
+#include <QtCore/qmath.h>
+#include <QtCore/qthreadpool.h>
+
+#include "imgui_internal.h"
+
+// The ones in imgui_draw.cpp are static, so have our own for building the
+// atlas (see fontBuilder()) and for rasterizing glyphs the same way after
+// the build. The packer has to be the same Dear ImGui packs custom rects
+// with. Warnings are suppressed the same way as in imgui_draw.cpp.
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable: 4456)                             // declaration of 'xx' hides previous local declaration
+#pragma warning (disable: 4505)                             // unreferenced local function has been removed
+#pragma warning (disable: 6011)                             // (stb_rectpack) Dereferencing NULL pointer 'cur->next'.
+#pragma warning (disable: 6385)                             // (stb_truetype) Reading invalid data from 'buffer'
+#pragma warning (disable: 28182)                            // (stb_rectpack) Dereferencing NULL pointer. 'cur' contains the same NULL value as 'cur->next' did.
+#endif
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-function"
+#pragma clang diagnostic ignored "-Wunused-parameter"
+#pragma clang diagnostic ignored "-Wmissing-prototypes"
+#pragma clang diagnostic ignored "-Wimplicit-fallthrough"
+#pragma clang diagnostic ignored "-Wcast-qual"
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wtype-limits"
+#pragma GCC diagnostic ignored "-Wcast-qual"
+#endif
+
+#define STBRP_STATIC
+#define STBRP_ASSERT(x) IM_ASSERT(x)
+#define STB_RECT_PACK_IMPLEMENTATION
+#include "imstb_rectpack.h"
+
+#define STBTT_STATIC
+#define STB_TRUETYPE_IMPLEMENTATION
+#include "imstb_truetype.h"
+
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif
+
+QT_BEGIN_NAMESPACE
+
+static quint64 nextFontAtlasGeneration()
+{
+    static QBasicAtomicInteger<quint64> lastGeneration = Q_BASIC_ATOMIC_INITIALIZER(0);
+    return lastGeneration.fetchAndAddRelaxed(1) + 1;
+}
+
+// Copies alpha values into image, which is either Format_Grayscale8 or
+// Format_RGBA8888 with white pixels.
+static void copyCoverage(QImage *image, const QPoint &pos, const uchar *src, int w, int h, int stride)
+{
+    for (int y = 0; y < h; ++y) {
+        const uchar *s = src + y * stride;
+        if (image->format() == QImage::Format_Grayscale8) {
+            memcpy(image->scanLine(pos.y() + y) + pos.x(), s, w);
+        } else {
+            quint32 *d = reinterpret_cast<quint32 *>(image->scanLine(pos.y() + y)) + pos.x();
+            for (int x = 0; x < w; ++x)
+                d[x] = qToLittleEndian(0x00FFFFFFu | (quint32(s[x]) << 24));
+        }
+    }
+}
+
+static void clearCoverage(QImage *image, const QRect &rect)
+{
+    for (int y = rect.top(); y <= rect.bottom(); ++y) {
+        if (image->format() == QImage::Format_Grayscale8) {
+            memset(image->scanLine(y) + rect.x(), 0, rect.width());
+        } else {
+            quint32 *d = reinterpret_cast<quint32 *>(image->scanLine(y)) + rect.x();
+            std::fill(d, d + rect.width(), qToLittleEndian(0x00FFFFFFu));
+        }
+    }
+}
+
+namespace {
+
+// stbtt_fontinfo for the configs of an atlas, set up on first use.
+struct FontInfos
+{
+    explicit FontInfos(const ImFontAtlas &atlas)
+        : atlas(atlas), info(atlas.ConfigData.Size), valid(atlas.ConfigData.Size, false)
+    { }
+
+    stbtt_fontinfo *get(int i)
+    {
+        if (!valid[i]) {
+            const ImFontConfig &cfg(atlas.ConfigData[i]);
+            const uchar *data = static_cast<const uchar *>(cfg.FontData);
+            stbtt_InitFont(&info[i], data, stbtt_GetFontOffsetForIndex(data, cfg.FontNo));
+            valid[i] = true;
+        }
+        return &info[i];
+    }
+
+    float scale(int i)
+    {
+        const ImFontConfig &cfg(atlas.ConfigData[i]);
+        return cfg.SizePixels > 0 ? stbtt_ScaleForPixelHeight(get(i), cfg.SizePixels)
+                                  : stbtt_ScaleForMappingEmToPixels(get(i), -cfg.SizePixels);
+    }
+
+    // the first source of the font that has c, like in the build, -1 if none
+    int configFor(const ImFont *font, uint c)
+    {
+        for (int i = 0; i < atlas.ConfigData.Size; ++i) {
+            if (atlas.ConfigData[i].DstFont == font && stbtt_FindGlyphIndex(get(i), int(c)))
+                return i;
+        }
+        return -1;
+    }
+
+    const ImFontAtlas &atlas;
+    QVector<stbtt_fontinfo> info;
+    QVector<bool> valid;
+};
+
+}
+
+// Distance in pixels (at the size of the font) covered by the distance
+// field on both sides of the edges.
+static const int DISTANCE_FIELD_SPREAD = 4;
+
+// Rasterizes c the same way as ImFontAtlasBuildWithStbTruetype(), or as a
+// distance field, at the place allocate(w, h) returns, and adds it to the
+// font of the config. Returns the rect written, a null one when there was
+// no room.
+template<typename Allocate>
+static QRect rasterizeGlyph(ImFontAtlas &atlas, QImage *image, FontInfos &infos, int configIndex, ImWchar c,
+                            bool distanceField, Allocate allocate)
+{
+    ImFontConfig &cfg(atlas.ConfigData[configIndex]);
+    stbtt_fontinfo *fi = infos.get(configIndex);
+    const float scale = infos.scale(configIndex);
+    const int glyphIndex = stbtt_FindGlyphIndex(fi, c);
+    const float offsetX = cfg.GlyphOffset.x;
+    const float offsetY = cfg.GlyphOffset.y + IM_ROUND(cfg.DstFont->Ascent);
+
+    if (distanceField) {
+        int advance, leftSideBearing;
+        stbtt_GetGlyphHMetrics(fi, glyphIndex, &advance, &leftSideBearing);
+        int w = 0, h = 0, x0 = 0, y0 = 0;
+        uchar *pixels = stbtt_GetGlyphSDF(fi, scale, glyphIndex, DISTANCE_FIELD_SPREAD, 128,
+                                          128.0f / DISTANCE_FIELD_SPREAD, &w, &h, &x0, &y0);
+        // the outermost texels are far outside already, 1 more is enough
+        // between neighbours
+        const QPoint pos = allocate(w + 1, h + 1);
+        if (pos.x() < 0) {
+            stbtt_FreeSDF(pixels, nullptr);
+            return QRect();
+        }
+        if (pixels) {
+            copyCoverage(image, pos, pixels, w, h, w);
+            stbtt_FreeSDF(pixels, nullptr);
+        }
+        const float u0 = pos.x() / float(atlas.TexWidth);
+        const float v0 = pos.y() / float(atlas.TexHeight);
+        const float u1 = (pos.x() + w) / float(atlas.TexWidth);
+        const float v1 = (pos.y() + h) / float(atlas.TexHeight);
+        cfg.DstFont->AddGlyph(&cfg, c, x0 + offsetX, y0 + offsetY, x0 + w + offsetX, y0 + h + offsetY,
+                              u0, v0, u1, v1, advance * scale);
+        return QRect(pos, QSize(w + 1, h + 1));
+    }
+
+    const int padding = atlas.TexGlyphPadding;
+    int x0, y0, x1, y1;
+    stbtt_GetGlyphBitmapBoxSubpixel(fi, glyphIndex, scale * cfg.OversampleH, scale * cfg.OversampleV,
+                                    0, 0, &x0, &y0, &x1, &y1);
+    const int w = x1 - x0 + padding + cfg.OversampleH - 1;
+    const int h = y1 - y0 + padding + cfg.OversampleV - 1;
+    const QPoint pos = allocate(w, h);
+    if (pos.x() < 0)
+        return QRect();
+
+    std::vector<uchar> pixels(size_t(w) * h, 0);
+    stbtt_pack_context spc = {};
+    stbtt_PackBegin(&spc, pixels.data(), w, h, w, padding, nullptr);
+    stbrp_rect r = {};
+    r.w = w;
+    r.h = h;
+    r.was_packed = 1;
+    int codepoint = c;
+    stbtt_packedchar pc = {};
+    stbtt_pack_range range = {};
+    range.font_size = cfg.SizePixels;
+    range.array_of_unicode_codepoints = &codepoint;
+    range.num_chars = 1;
+    range.chardata_for_range = &pc;
+    range.h_oversample = uchar(cfg.OversampleH);
+    range.v_oversample = uchar(cfg.OversampleV);
+    stbtt_PackFontRangesRenderIntoRects(&spc, fi, &range, 1, &r);
+    stbtt_PackEnd(&spc);
+    if (cfg.RasterizerMultiply != 1.0f) {
+        uchar multiplyTable[256];
+        for (int v = 0; v < 256; ++v)
+            multiplyTable[v] = uchar(qMin(255u, uint(v * cfg.RasterizerMultiply)));
+        for (uchar &v : pixels)
+            v = multiplyTable[v];
+    }
+    copyCoverage(image, pos, pixels.data(), w, h, w);
+
+    pc.x0 += pos.x();
+    pc.x1 += pos.x();
+    pc.y0 += pos.y();
+    pc.y1 += pos.y();
+    stbtt_aligned_quad q;
+    float unusedX = 0.0f, unusedY = 0.0f;
+    stbtt_GetPackedQuad(&pc, atlas.TexWidth, atlas.TexHeight, 0, &unusedX, &unusedY, &q, 0);
+    cfg.DstFont->AddGlyph(&cfg, c, q.x0 + offsetX, q.y0 + offsetY, q.x1 + offsetX, q.y1 + offsetY,
+                          q.s0, q.t0, q.s1, q.t1, pc.xadvance);
+    return QRect(pos, QSize(w, h));
+}
+
+// Replaces the glyph with the last one of the font, which rasterizeGlyph()
+// appended. The lookup tables stay valid this way.
+static void replaceWithLastGlyph(ImFont *font, ImWchar c)
+{
+    const ImFontGlyph glyph = font->Glyphs.back();
+    font->Glyphs.pop_back();
+    *const_cast<ImFontGlyph *>(font->FindGlyphNoFallback(c)) = glyph;
+}
+
+// Glyphs in the glyph cache ranges that are not cached are visible, but
+// empty, so that the quads still get generated, with the codepoint and the
+// font in the texture coordinates.
+static void setPlaceholder(ImFontGlyph *glyph, int font)
+{
+    glyph->Visible = 1;
+    glyph->Colored = 0;
+    glyph->X0 = glyph->Y0 = glyph->X1 = glyph->Y1 = 0.0f;
+    glyph->U0 = glyph->U1 = -1.0f - float(glyph->Codepoint);
+    glyph->V0 = glyph->V1 = -1.0f - float(font);
+}
+
+static inline bool isPlaceholder(const ImFontGlyph *glyph)
+{
+    return glyph->U0 < 0.0f;
+}
+
+static const int GLYPH_CACHE_PAGE_SIZE = 256;
+
+// ImFontAtlasBuildWithStbTruetype() with the per glyph work (measuring and
+// rasterizing) split into tasks, GLYPHS_PER_TASK glyphs of one config each,
+// that run on a thread pool. Packing stays serial and in the same order, so
+// the result is the same as what Dear ImGui's own builder produces. Or,
+// with distanceField, the same layout with the distance fields the way
+// rasterizeGlyph() makes them.
+static const int GLYPHS_PER_TASK = 256;
+
+namespace {
+
+struct BuildSource
+{
+    stbtt_fontinfo fontInfo;
+    int dstIndex = -1;
+    int glyphsHighest = 0;
+    ImBitVector glyphsSet;
+    QVector<int> glyphs;
+    QVector<stbrp_rect> rects;
+    QVector<stbtt_packedchar> packedChars;
+};
+
+struct BuildTask
+{
+    int source;
+    int first;
+    int count;
+};
+
+}
+
+// Not the global pool, waitForDone() would wait for unrelated tasks there too.
+template<typename Task>
+static void runBuildTasks(const QVector<BuildTask> &tasks, Task task)
+{
+    if (tasks.count() <= 1) {
+        for (const BuildTask &t : tasks)
+            task(t);
+        return;
+    }
+    QThreadPool pool;
+    for (const BuildTask &t : tasks)
+        pool.start([&task, t] { task(t); });
+    pool.waitForDone();
+}
+
+static bool buildFontAtlas(ImFontAtlas *atlas, bool distanceField)
+{
+    IM_ASSERT(atlas->ConfigData.Size > 0);
+
+    ImFontAtlasBuildInit(atlas);
+
+    atlas->TexID = ImTextureID(nullptr);
+    atlas->TexWidth = atlas->TexHeight = 0;
+    atlas->TexUvScale = ImVec2(0.0f, 0.0f);
+    atlas->TexUvWhitePixel = ImVec2(0.0f, 0.0f);
+    atlas->ClearTexData();
+
+    // Gather: the codepoints each config gets, the earlier configs of the
+    // same font win.
+    std::vector<BuildSource> sources(size_t(atlas->ConfigData.Size));
+    std::vector<ImBitVector> fontGlyphsSets(size_t(atlas->Fonts.Size));
+    QVector<int> fontGlyphsHighest(atlas->Fonts.Size, 0);
+    for (int i = 0; i < atlas->ConfigData.Size; ++i) {
+        BuildSource &src(sources[i]);
+        ImFontConfig &cfg(atlas->ConfigData[i]);
+        IM_ASSERT(cfg.DstFont && (!cfg.DstFont->IsLoaded() || cfg.DstFont->ContainerAtlas == atlas));
+        for (int f = 0; f < atlas->Fonts.Size && src.dstIndex < 0; ++f) {
+            if (cfg.DstFont == atlas->Fonts[f])
+                src.dstIndex = f;
+        }
+        if (src.dstIndex < 0)
+            return false;
+        const int offset = stbtt_GetFontOffsetForIndex(static_cast<const uchar *>(cfg.FontData), cfg.FontNo);
+        IM_ASSERT(offset >= 0 && "FontData is incorrect, or FontNo cannot be found.");
+        if (!stbtt_InitFont(&src.fontInfo, static_cast<const uchar *>(cfg.FontData), offset))
+            return false;
+        const ImWchar *ranges = cfg.GlyphRanges ? cfg.GlyphRanges : atlas->GetGlyphRangesDefault();
+        for (const ImWchar *r = ranges; r[0] && r[1]; r += 2)
+            src.glyphsHighest = qMax(src.glyphsHighest, int(r[1]));
+        fontGlyphsHighest[src.dstIndex] = qMax(fontGlyphsHighest[src.dstIndex], src.glyphsHighest);
+    }
+    for (int i = 0; i < atlas->ConfigData.Size; ++i) {
+        BuildSource &src(sources[i]);
+        ImBitVector &fontGlyphsSet(fontGlyphsSets[src.dstIndex]);
+        src.glyphsSet.Create(src.glyphsHighest + 1);
+        if (fontGlyphsSet.Storage.empty())
+            fontGlyphsSet.Create(fontGlyphsHighest[src.dstIndex] + 1);
+        const ImFontConfig &cfg(atlas->ConfigData[i]);
+        const ImWchar *ranges = cfg.GlyphRanges ? cfg.GlyphRanges : atlas->GetGlyphRangesDefault();
+        for (const ImWchar *r = ranges; r[0] && r[1]; r += 2) {
+            for (uint c = r[0]; c <= r[1]; ++c) {
+                if (fontGlyphsSet.TestBit(int(c)) || !stbtt_FindGlyphIndex(&src.fontInfo, int(c)))
+                    continue;
+                src.glyphsSet.SetBit(int(c));
+                fontGlyphsSet.SetBit(int(c));
+            }
+        }
+    }
+    fontGlyphsSets.clear();
+
+    QVector<BuildTask> tasks;
+    for (int i = 0; i < atlas->ConfigData.Size; ++i) {
+        BuildSource &src(sources[i]);
+        for (int c = 0; c <= src.glyphsHighest; ++c) {
+            if (src.glyphsSet.TestBit(c))
+                src.glyphs.append(c);
+        }
+        src.glyphsSet.Clear();
+        src.rects.resize(src.glyphs.count());
+        src.packedChars.resize(src.glyphs.count());
+        for (int first = 0; first < src.glyphs.count(); first += GLYPHS_PER_TASK)
+            tasks.append({ i, first, qMin(GLYPHS_PER_TASK, src.glyphs.count() - first) });
+    }
+
+    // Measure the glyphs, the rect sizes are what packing needs. Distance
+    // fields are not oversampled, and have the spread on all sides (see
+    // stbtt_GetGlyphSDF()).
+    const int padding = atlas->TexGlyphPadding;
+    runBuildTasks(tasks, [atlas, &sources, padding, distanceField](const BuildTask &t) {
+        BuildSource &src(sources[t.source]);
+        const ImFontConfig &cfg(atlas->ConfigData[t.source]);
+        const float scale = cfg.SizePixels > 0 ? stbtt_ScaleForPixelHeight(&src.fontInfo, cfg.SizePixels)
+                                               : stbtt_ScaleForMappingEmToPixels(&src.fontInfo, -cfg.SizePixels);
+        for (int i = t.first; i < t.first + t.count; ++i) {
+            const int glyphIndex = stbtt_FindGlyphIndex(&src.fontInfo, src.glyphs[i]);
+            stbrp_rect &r(src.rects[i]);
+            r = {};
+            int x0, y0, x1, y1;
+            if (distanceField) {
+                stbtt_GetGlyphBitmapBoxSubpixel(&src.fontInfo, glyphIndex, scale, scale, 0, 0, &x0, &y0, &x1, &y1);
+                const bool empty = x0 == x1 || y0 == y1;
+                r.w = stbrp_coord(empty ? padding : x1 - x0 + 2 * DISTANCE_FIELD_SPREAD + padding);
+                r.h = stbrp_coord(empty ? padding : y1 - y0 + 2 * DISTANCE_FIELD_SPREAD + padding);
+                continue;
+            }
+            stbtt_GetGlyphBitmapBoxSubpixel(&src.fontInfo, glyphIndex, scale * cfg.OversampleH, scale * cfg.OversampleV,
+                                            0, 0, &x0, &y0, &x1, &y1);
+            r.w = stbrp_coord(x1 - x0 + padding + cfg.OversampleH - 1);
+            r.h = stbrp_coord(y1 - y0 + padding + cfg.OversampleV - 1);
+        }
+    });
+
+    // Pack, custom rects first so that they end up in the top left corner.
+    int totalSurface = 0;
+    for (const BuildSource &src : sources) {
+        for (const stbrp_rect &r : src.rects)
+            totalSurface += r.w * r.h;
+    }
+    const int surfaceSqrt = int(ImSqrt(float(totalSurface))) + 1;
+    atlas->TexHeight = 0;
+    if (atlas->TexDesiredWidth > 0)
+        atlas->TexWidth = atlas->TexDesiredWidth;
+    else
+        atlas->TexWidth = surfaceSqrt >= 4096 * 0.7f ? 4096 : surfaceSqrt >= 2048 * 0.7f ? 2048 : surfaceSqrt >= 1024 * 0.7f ? 1024 : 512;
+
+    const int TEX_HEIGHT_MAX = 1024 * 32;
+    stbtt_pack_context spc = {};
+    stbtt_PackBegin(&spc, nullptr, atlas->TexWidth, TEX_HEIGHT_MAX, 0, padding, nullptr);
+    ImFontAtlasBuildPackCustomRects(atlas, spc.pack_info);
+    for (BuildSource &src : sources) {
+        if (src.rects.isEmpty())
+            continue;
+        stbrp_pack_rects(static_cast<stbrp_context *>(spc.pack_info), src.rects.data(), src.rects.count());
+        for (const stbrp_rect &r : src.rects) {
+            if (r.was_packed)
+                atlas->TexHeight = qMax(atlas->TexHeight, r.y + r.h);
+        }
+    }
+
+    atlas->TexHeight = (atlas->Flags & ImFontAtlasFlags_NoPowerOfTwoHeight) ? atlas->TexHeight + 1
+                                                                            : ImUpperPowerOfTwo(atlas->TexHeight);
+    atlas->TexUvScale = ImVec2(1.0f / atlas->TexWidth, 1.0f / atlas->TexHeight);
+    atlas->TexPixelsAlpha8 = static_cast<uchar *>(IM_ALLOC(size_t(atlas->TexWidth) * atlas->TexHeight));
+    memset(atlas->TexPixelsAlpha8, 0, size_t(atlas->TexWidth) * atlas->TexHeight);
+    spc.pixels = atlas->TexPixelsAlpha8;
+    spc.height = atlas->TexHeight;
+
+    // Render. The rects of the tasks do not overlap, each task only needs
+    // its own copy of the pack context (rendering changes the oversampling
+    // in it). Distance fields go to the top left of their rects, with the
+    // packed chars filled in the way stbtt_PackFontRangesRenderIntoRects()
+    // does.
+    runBuildTasks(tasks, [atlas, &sources, &spc, distanceField](const BuildTask &t) {
+        BuildSource &src(sources[t.source]);
+        const ImFontConfig &cfg(atlas->ConfigData[t.source]);
+        if (distanceField) {
+            const float scale = cfg.SizePixels > 0 ? stbtt_ScaleForPixelHeight(&src.fontInfo, cfg.SizePixels)
+                                                   : stbtt_ScaleForMappingEmToPixels(&src.fontInfo, -cfg.SizePixels);
+            for (int i = t.first; i < t.first + t.count; ++i) {
+                const stbrp_rect &r(src.rects[i]);
+                stbtt_packedchar &pc(src.packedChars[i]);
+                pc = {};
+                if (!r.was_packed)
+                    continue;
+                const int glyphIndex = stbtt_FindGlyphIndex(&src.fontInfo, src.glyphs[i]);
+                int advance, leftSideBearing;
+                stbtt_GetGlyphHMetrics(&src.fontInfo, glyphIndex, &advance, &leftSideBearing);
+                pc.xadvance = advance * scale;
+                int w = 0, h = 0, x0 = 0, y0 = 0;
+                uchar *pixels = stbtt_GetGlyphSDF(&src.fontInfo, scale, glyphIndex, DISTANCE_FIELD_SPREAD, 128,
+                                                  128.0f / DISTANCE_FIELD_SPREAD, &w, &h, &x0, &y0);
+                if (!pixels)
+                    continue;
+                for (int y = 0; y < h; ++y)
+                    memcpy(atlas->TexPixelsAlpha8 + size_t(r.y + y) * atlas->TexWidth + r.x, pixels + y * w, size_t(w));
+                stbtt_FreeSDF(pixels, nullptr);
+                pc.x0 = quint16(r.x);
+                pc.y0 = quint16(r.y);
+                pc.x1 = quint16(r.x + w);
+                pc.y1 = quint16(r.y + h);
+                pc.xoff = float(x0);
+                pc.yoff = float(y0);
+                pc.xoff2 = float(x0 + w);
+                pc.yoff2 = float(y0 + h);
+            }
+            return;
+        }
+        stbtt_pack_context taskSpc = spc;
+        stbtt_pack_range range = {};
+        range.font_size = cfg.SizePixels;
+        range.array_of_unicode_codepoints = src.glyphs.data() + t.first;
+        range.num_chars = t.count;
+        range.chardata_for_range = src.packedChars.data() + t.first;
+        range.h_oversample = uchar(cfg.OversampleH);
+        range.v_oversample = uchar(cfg.OversampleV);
+        stbrp_rect *rects = src.rects.data() + t.first;
+        stbtt_PackFontRangesRenderIntoRects(&taskSpc, &src.fontInfo, &range, 1, rects);
+        if (cfg.RasterizerMultiply != 1.0f) {
+            uchar multiplyTable[256];
+            ImFontAtlasBuildMultiplyCalcLookupTable(multiplyTable, cfg.RasterizerMultiply);
+            for (int i = 0; i < t.count; ++i) {
+                const stbrp_rect &r(rects[i]);
+                if (r.was_packed)
+                    ImFontAtlasBuildMultiplyRectAlpha8(multiplyTable, atlas->TexPixelsAlpha8, r.x, r.y, r.w, r.h, atlas->TexWidth);
+            }
+        }
+    });
+    stbtt_PackEnd(&spc);
+
+    // Set up the fonts and add the glyphs, in config order.
+    for (int i = 0; i < atlas->ConfigData.Size; ++i) {
+        BuildSource &src(sources[i]);
+        if (src.glyphs.isEmpty())
+            continue;
+        ImFontConfig &cfg(atlas->ConfigData[i]);
+        ImFont *font = cfg.DstFont;
+        const float fontScale = stbtt_ScaleForPixelHeight(&src.fontInfo, cfg.SizePixels);
+        int unscaledAscent, unscaledDescent, unscaledLineGap;
+        stbtt_GetFontVMetrics(&src.fontInfo, &unscaledAscent, &unscaledDescent, &unscaledLineGap);
+        const float ascent = ImFloor(unscaledAscent * fontScale + (unscaledAscent > 0 ? 1 : -1));
+        const float descent = ImFloor(unscaledDescent * fontScale + (unscaledDescent > 0 ? 1 : -1));
+        ImFontAtlasBuildSetupFont(atlas, font, &cfg, ascent, descent);
+        const float offsetX = cfg.GlyphOffset.x;
+        const float offsetY = cfg.GlyphOffset.y + IM_ROUND(font->Ascent);
+        for (int g = 0; g < src.glyphs.count(); ++g) {
+            stbtt_aligned_quad q;
+            float unusedX = 0.0f, unusedY = 0.0f;
+            stbtt_GetPackedQuad(src.packedChars.data(), atlas->TexWidth, atlas->TexHeight, g, &unusedX, &unusedY, &q, 0);
+            font->AddGlyph(&cfg, ImWchar(src.glyphs[g]), q.x0 + offsetX, q.y0 + offsetY, q.x1 + offsetX, q.y1 + offsetY,
+                           q.s0, q.t0, q.s1, q.t1, src.packedChars[g].xadvance);
+        }
+    }
+
+    ImFontAtlasBuildFinish(atlas);
+    return true;
+}
+
+static bool buildBitmapFontAtlas(ImFontAtlas *atlas)
+{
+    return buildFontAtlas(atlas, false);
+}
+
+static bool buildDistanceFieldFontAtlas(ImFontAtlas *atlas)
+{
+    return buildFontAtlas(atlas, true);
+}
+
+static const ImFontBuilderIO *fontBuilder(bool distanceField)
+{
+    static const ImFontBuilderIO bitmapIO = { buildBitmapFontAtlas };
+    static const ImFontBuilderIO distanceFieldIO = { buildDistanceFieldFontAtlas };
+    return distanceField ? &distanceFieldIO : &bitmapIO;
+}
+
+QRhiImguiFontAtlas::QRhiImguiFontAtlas()
+{
+    atlas.FontBuilderIO = fontBuilder(false);
+}
+
+void QRhiImguiFontAtlas::build()
+{
+    while (glyphCachePageRects.count() < glyphCachePageCount)
+        glyphCachePageRects.append(atlas.AddCustomRectRegular(GLYPH_CACHE_PAGE_SIZE, GLYPH_CACHE_PAGE_SIZE));
+
+    // Skipped entirely when the cache has the result for the same input.
+    QByteArray key;
+    QString cacheFile;
+    if (!cacheDirectory.isEmpty()) {
+        key = cacheKey();
+        cacheFile = QDir(cacheDirectory).filePath(QString::fromLatin1(key.toHex()) + QLatin1String(".qrhiimguiatlas"));
+    }
+    if (cacheFile.isEmpty() || !loadCache(cacheFile, key)) {
+        if (distanceField && atlas.FontBuilderIO != fontBuilder(true))
+            qWarning("Distance field fonts need the default font builder, the glyphs are bitmaps");
+        unsigned char *pixels;
+        int w, h;
+        if (singleChannel) {
+            atlas.GetTexDataAsAlpha8(&pixels, &w, &h);
+            const QImage wrapperImg(const_cast<const uchar *>(pixels), w, h, w, QImage::Format_Grayscale8);
+            image = wrapperImg.copy();
+        } else {
+            atlas.GetTexDataAsRGBA32(&pixels, &w, &h);
+            const QImage wrapperImg(const_cast<const uchar *>(pixels), w, h, QImage::Format_RGBA8888);
+            image = wrapperImg.copy();
+        }
+        if (!cacheFile.isEmpty())
+            saveCache(cacheFile, key);
+    }
+    const int w = atlas.TexWidth;
+    const int h = atlas.TexHeight;
+
+    // The build packs everything from the top, what is below is free for
+    // addGlyphs() and addImage(). Custom rects were placed by the build,
+    // their contents are ours to fill.
+    int usedHeight = 0;
+    for (const ImFont *font : atlas.Fonts) {
+        for (const ImFontGlyph &glyph : font->Glyphs)
+            usedHeight = qMax(usedHeight, qCeil(glyph.V1 * h));
+    }
+    for (int i = 0; i < atlas.CustomRects.Size; ++i) {
+        const ImFontAtlasCustomRect &r(atlas.CustomRects[i]);
+        if (!r.IsPacked())
+            continue;
+        usedHeight = qMax(usedHeight, r.Y + r.Height);
+        auto it = customImages.constFind(i);
+        if (it != customImages.cend())
+            copyImage(*it, QPoint(r.X, r.Y));
+    }
+    const int freeY = usedHeight + atlas.TexGlyphPadding;
+    freeSpace.reset(QRect(0, freeY, w, h - freeY));
+
+    setUpGlyphCache();
+
+    generation = nextFontAtlasGeneration();
+    baseGeneration = generation;
+    updates.clear();
+
+    // Glyph data and metrics stay, only the pixels (both the alpha and the
+    // RGBA ones) go. Getting them again rebuilds the atlas.
+    atlas.ClearTexData();
+    atlas.SetTexID(nullptr);
+}
+
+void QRhiImguiFontAtlas::clearFonts()
+{
+    atlas.Clear();
+    fontData.clear();
+    fontFiles.clear();
+    glyphRanges.clear();
+    customImages.clear();
+    glyphCachePageRects.clear();
+    glyphCachePages.clear();
+}
+
+QByteArray QRhiImguiFontAtlas::addFontFile(std::unique_ptr<QFile> f)
+{
+    QByteArray data;
+    if (const uchar *p = f->map(0, f->size())) {
+        data = QByteArray::fromRawData(reinterpret_cast<const char *>(p), f->size());
+        fontFiles.push_back(std::move(f));
+    } else {
+        data = f->readAll();
+    }
+    fontData.append(data);
+    return data;
+}
+
+void QRhiImguiFontAtlas::setDistanceField(bool enable)
+{
+    if (distanceField == enable)
+        return;
+    distanceField = enable;
+    // The build rasterizes the distance fields, a builder set by the
+    // application stays. No anti-aliased line textures, those would be
+    // treated as distance fields too.
+    if (atlas.FontBuilderIO == fontBuilder(!enable))
+        atlas.FontBuilderIO = fontBuilder(enable);
+    if (enable) {
+        bitmapNoBakedLines = atlas.Flags & ImFontAtlasFlags_NoBakedLines;
+        atlas.Flags |= ImFontAtlasFlags_NoBakedLines;
+    } else if (!bitmapNoBakedLines) {
+        atlas.Flags &= ~ImFontAtlasFlags_NoBakedLines;
+    }
+}
+
+// The layout of the cache files, in this order: header, custom rects,
+// fonts, the glyphs of all fonts, the pixels (at a 16 byte boundary). Only
+// for the same machine and build, the pixels get mapped as they are.
+static const char ATLAS_CACHE_MAGIC[8] = { 'Q', 'R', 'I', 'G', 'A', 'T', 'L', 'S' };
+static const quint32 ATLAS_CACHE_VERSION = 2;
+
+struct AtlasCacheHeader
+{
+    char magic[8];
+    quint32 version;
+    quint32 glyphSize;
+    char key[20];
+    qint32 texWidth;
+    qint32 texHeight;
+    qint32 bytesPerLine;
+    qint32 format;
+    qint32 customRectCount;
+    qint32 fontCount;
+    qint32 packIdMouseCursors;
+    qint32 packIdLines;
+    float uvWhitePixel[2];
+    float uvLines[IM_DRAWLIST_TEX_LINES_WIDTH_MAX + 1][4];
+};
+
+struct AtlasCacheCustomRect
+{
+    quint16 width;
+    quint16 height;
+    quint16 x;
+    quint16 y;
+    quint32 glyphId;
+    float glyphAdvanceX;
+    float glyphOffset[2];
+    qint32 font;
+};
+
+struct AtlasCacheFont
+{
+    float ascent;
+    float descent;
+    qint32 metricsTotalSurface;
+    qint32 glyphCount;
+};
+
+static int fontIndex(const ImFontAtlas &atlas, const ImFont *font)
+{
+    for (int i = 0; i < atlas.Fonts.Size; ++i) {
+        if (atlas.Fonts[i] == font)
+            return i;
+    }
+    return -1;
+}
+
+template<typename T>
+static void addToHash(QCryptographicHash *hash, const T &value)
+{
+    hash->addData(QByteArray::fromRawData(reinterpret_cast<const char *>(&value), sizeof(T)));
+}
+
+// Everything the build depends on: the font data, the configs, the settings
+// of the atlas and the custom rects.
+QByteArray QRhiImguiFontAtlas::cacheKey() const
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    addToHash(&hash, ATLAS_CACHE_VERSION);
+    addToHash(&hash, IMGUI_VERSION_NUM);
+    addToHash(&hash, atlas.Flags);
+    addToHash(&hash, atlas.TexDesiredWidth);
+    addToHash(&hash, atlas.TexGlyphPadding);
+    addToHash(&hash, atlas.FontBuilderIO != nullptr && atlas.FontBuilderIO != fontBuilder(distanceField));
+    addToHash(&hash, singleChannel);
+    addToHash(&hash, distanceField);
+
+    QHash<const void *, QByteArray> fontDataHashes;
+    for (const ImFontConfig &cfg : atlas.ConfigData) {
+        QByteArray &dataHash(fontDataHashes[cfg.FontData]);
+        if (dataHash.isEmpty()) {
+            dataHash = QCryptographicHash::hash(QByteArray::fromRawData(static_cast<const char *>(cfg.FontData),
+                                                                        cfg.FontDataSize),
+                                                QCryptographicHash::Sha1);
+        }
+        hash.addData(dataHash);
+        addToHash(&hash, cfg.FontNo);
+        addToHash(&hash, cfg.SizePixels);
+        addToHash(&hash, cfg.OversampleH);
+        addToHash(&hash, cfg.OversampleV);
+        addToHash(&hash, cfg.PixelSnapH);
+        addToHash(&hash, cfg.GlyphExtraSpacing);
+        addToHash(&hash, cfg.GlyphOffset);
+        addToHash(&hash, cfg.GlyphMinAdvanceX);
+        addToHash(&hash, cfg.GlyphMaxAdvanceX);
+        addToHash(&hash, cfg.MergeMode);
+        addToHash(&hash, cfg.FontBuilderFlags);
+        addToHash(&hash, cfg.RasterizerMultiply);
+        addToHash(&hash, cfg.EllipsisChar);
+        addToHash(&hash, fontIndex(atlas, cfg.DstFont));
+        for (const ImWchar *r = cfg.GlyphRanges ? cfg.GlyphRanges : atlas.GetGlyphRangesDefault(); r[0]; r += 2) {
+            addToHash(&hash, r[0]);
+            addToHash(&hash, r[1]);
+        }
+        addToHash(&hash, ImWchar(0));
+    }
+
+    for (const ImFontAtlasCustomRect &r : atlas.CustomRects) {
+        addToHash(&hash, r.Width);
+        addToHash(&hash, r.Height);
+        addToHash(&hash, r.GlyphID);
+        addToHash(&hash, r.GlyphAdvanceX);
+        addToHash(&hash, r.GlyphOffset);
+        addToHash(&hash, fontIndex(atlas, r.Font));
+    }
+    addToHash(&hash, atlas.PackIdMouseCursors);
+    addToHash(&hash, atlas.PackIdLines);
+
+    return hash.result();
+}
+
+// Does what the build would, with the results from the file. Everything in
+// it is checked before use, a damaged file or one from another build must
+// only mean a build.
+bool QRhiImguiFontAtlas::loadCache(const QString &filename, const QByteArray &key)
+{
+    std::unique_ptr<QFile> f(new QFile(filename));
+    if (!f->open(QIODevice::ReadOnly) || f->size() < qint64(sizeof(AtlasCacheHeader)))
+        return false;
+    const qint64 size = f->size();
+    const uchar *data = f->map(0, size);
+    if (!data)
+        return false;
+
+    AtlasCacheHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, ATLAS_CACHE_MAGIC, sizeof(header.magic)) || header.version != ATLAS_CACHE_VERSION
+            || header.glyphSize != sizeof(ImFontGlyph) || key != QByteArray::fromRawData(header.key, sizeof(header.key))
+            || header.fontCount != atlas.Fonts.Size || header.customRectCount < atlas.CustomRects.Size
+            || header.customRectCount < 0
+            || header.format != (singleChannel ? QImage::Format_Grayscale8 : QImage::Format_RGBA8888))
+    {
+        return false;
+    }
+    const int bytesPerPixel = singleChannel ? 1 : 4;
+    if (header.texWidth <= 0 || header.texHeight <= 0 || header.texWidth > 65536 || header.texHeight > 65536
+            || header.bytesPerLine < qint64(header.texWidth) * bytesPerPixel
+            || header.packIdMouseCursors < -1 || header.packIdMouseCursors >= header.customRectCount
+            || header.packIdLines < -1 || header.packIdLines >= header.customRectCount)
+    {
+        return false;
+    }
+
+    qint64 offset = sizeof(AtlasCacheHeader);
+    const qint64 rectsOffset = offset;
+    offset += header.customRectCount * qint64(sizeof(AtlasCacheCustomRect));
+    const qint64 fontsOffset = offset;
+    offset += header.fontCount * qint64(sizeof(AtlasCacheFont));
+    if (offset > size)
+        return false;
+    std::vector<AtlasCacheFont> fonts(header.fontCount);
+    memcpy(fonts.data(), data + fontsOffset, fonts.size() * sizeof(AtlasCacheFont));
+    const qint64 glyphsOffset = offset;
+    for (const AtlasCacheFont &font : fonts) {
+        if (font.glyphCount < 0)
+            return false;
+        offset += font.glyphCount * qint64(sizeof(ImFontGlyph));
+        if (offset > size)
+            return false;
+    }
+    const qint64 pixelsOffset = (offset + 15) & ~qint64(15);
+    if (pixelsOffset + qint64(header.bytesPerLine) * header.texHeight > size)
+        return false;
+
+    // the lookup tables are as large as the highest codepoint
+    for (qint64 g = glyphsOffset; g < offset; g += sizeof(ImFontGlyph)) {
+        ImFontGlyph glyph;
+        memcpy(&glyph, data + g, sizeof(glyph));
+        if (glyph.Codepoint > IM_UNICODE_CODEPOINT_MAX)
+            return false;
+    }
+    for (int i = 0; i < header.customRectCount; ++i) {
+        AtlasCacheCustomRect c;
+        memcpy(&c, data + rectsOffset + i * sizeof(AtlasCacheCustomRect), sizeof(c));
+        // not packed, see ImFontAtlasCustomRect::IsPacked()
+        if (c.x == 0xFFFF)
+            continue;
+        if (int(c.x) + c.width > header.texWidth || int(c.y) + c.height > header.texHeight)
+            return false;
+    }
+
+    atlas.TexWidth = header.texWidth;
+    atlas.TexHeight = header.texHeight;
+    atlas.TexUvScale = ImVec2(1.0f / atlas.TexWidth, 1.0f / atlas.TexHeight);
+    atlas.TexUvWhitePixel = ImVec2(header.uvWhitePixel[0], header.uvWhitePixel[1]);
+    for (int i = 0; i <= IM_DRAWLIST_TEX_LINES_WIDTH_MAX; ++i) {
+        const float *uv = header.uvLines[i];
+        atlas.TexUvLines[i] = ImVec4(uv[0], uv[1], uv[2], uv[3]);
+    }
+    // the build adds the ones for the mouse cursors and the lines
+    atlas.CustomRects.resize(header.customRectCount);
+    for (int i = 0; i < header.customRectCount; ++i) {
+        AtlasCacheCustomRect c;
+        memcpy(&c, data + rectsOffset + i * sizeof(AtlasCacheCustomRect), sizeof(c));
+        ImFontAtlasCustomRect &r(atlas.CustomRects[i]);
+        r.Width = c.width;
+        r.Height = c.height;
+        r.X = c.x;
+        r.Y = c.y;
+        r.GlyphID = c.glyphId;
+        r.GlyphAdvanceX = c.glyphAdvanceX;
+        r.GlyphOffset = ImVec2(c.glyphOffset[0], c.glyphOffset[1]);
+        r.Font = c.font >= 0 && c.font < atlas.Fonts.Size ? atlas.Fonts[c.font] : nullptr;
+    }
+    atlas.PackIdMouseCursors = header.packIdMouseCursors;
+    atlas.PackIdLines = header.packIdLines;
+
+    for (ImFontConfig &cfg : atlas.ConfigData) {
+        const AtlasCacheFont &font(fonts[fontIndex(atlas, cfg.DstFont)]);
+        ImFontAtlasBuildSetupFont(&atlas, cfg.DstFont, &cfg, font.ascent, font.descent);
+    }
+    const uchar *glyphs = data + glyphsOffset;
+    for (int i = 0; i < atlas.Fonts.Size; ++i) {
+        ImFont *font = atlas.Fonts[i];
+        font->Glyphs.resize(fonts[i].glyphCount);
+        memcpy(font->Glyphs.Data, glyphs, fonts[i].glyphCount * sizeof(ImFontGlyph));
+        glyphs += fonts[i].glyphCount * sizeof(ImFontGlyph);
+        font->MetricsTotalSurface = fonts[i].metricsTotalSurface;
+        font->BuildLookupTable();
+    }
+    atlas.TexReady = true;
+
+    // The pixels are used from the mapping until the image is modified,
+    // that and the copies given to the renderers keep the file open.
+    image = QImage(data + pixelsOffset, header.texWidth, header.texHeight, header.bytesPerLine,
+                   QImage::Format(header.format), [](void *file) { delete static_cast<QFile *>(file); },
+                   f.release());
+    return true;
+}
+
+void QRhiImguiFontAtlas::saveCache(const QString &filename, const QByteArray &key) const
+{
+    QSaveFile f(filename);
+    if (!f.open(QIODevice::WriteOnly)) {
+        qWarning("Failed to write font atlas cache to %s", qPrintable(filename));
+        return;
+    }
+
+    AtlasCacheHeader header = {};
+    memcpy(header.magic, ATLAS_CACHE_MAGIC, sizeof(header.magic));
+    header.version = ATLAS_CACHE_VERSION;
+    header.glyphSize = sizeof(ImFontGlyph);
+    memcpy(header.key, key.constData(), qMin(key.size(), qsizetype(sizeof(header.key))));
+    header.texWidth = atlas.TexWidth;
+    header.texHeight = atlas.TexHeight;
+    header.bytesPerLine = image.bytesPerLine();
+    header.format = image.format();
+    header.customRectCount = atlas.CustomRects.Size;
+    header.fontCount = atlas.Fonts.Size;
+    header.packIdMouseCursors = atlas.PackIdMouseCursors;
+    header.packIdLines = atlas.PackIdLines;
+    header.uvWhitePixel[0] = atlas.TexUvWhitePixel.x;
+    header.uvWhitePixel[1] = atlas.TexUvWhitePixel.y;
+    for (int i = 0; i <= IM_DRAWLIST_TEX_LINES_WIDTH_MAX; ++i) {
+        const ImVec4 &uv(atlas.TexUvLines[i]);
+        header.uvLines[i][0] = uv.x;
+        header.uvLines[i][1] = uv.y;
+        header.uvLines[i][2] = uv.z;
+        header.uvLines[i][3] = uv.w;
+    }
+    qint64 offset = f.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    for (const ImFontAtlasCustomRect &r : atlas.CustomRects) {
+        const AtlasCacheCustomRect c = { r.Width, r.Height, r.X, r.Y, r.GlyphID, r.GlyphAdvanceX,
+                                         { r.GlyphOffset.x, r.GlyphOffset.y }, fontIndex(atlas, r.Font) };
+        offset += f.write(reinterpret_cast<const char *>(&c), sizeof(c));
+    }
+    for (const ImFont *font : atlas.Fonts) {
+        const AtlasCacheFont c = { font->Ascent, font->Descent, font->MetricsTotalSurface, font->Glyphs.Size };
+        offset += f.write(reinterpret_cast<const char *>(&c), sizeof(c));
+    }
+    for (const ImFont *font : atlas.Fonts)
+        offset += f.write(reinterpret_cast<const char *>(font->Glyphs.Data), font->Glyphs.Size * sizeof(ImFontGlyph));
+    const QByteArray padding(((offset + 15) & ~qint64(15)) - offset, '\0');
+    f.write(padding);
+    f.write(reinterpret_cast<const char *>(image.constBits()), image.sizeInBytes());
+
+    if (!f.commit())
+        qWarning("Failed to write font atlas cache to %s", qPrintable(filename));
+}
+
+void QRhiImguiFontAtlas::updated(const QRect &rect)
+{
+    // Beyond this many, a full upload is cheaper than keeping track.
+    static const int MAX_UPDATES = 256;
+    generation = nextFontAtlasGeneration();
+    if (updates.count() >= MAX_UPDATES) {
+        baseGeneration = generation;
+        updates.clear();
+    } else {
+        updates.append({ generation, rect });
+    }
+}
+
+QPoint QRhiImguiFontAtlas::ShelfPacker::allocate(int w, int h)
+{
+    if (x + w > area.width()) {
+        y += rowHeight;
+        x = 0;
+        rowHeight = 0;
+    }
+    if (w > area.width() || y + h > area.height())
+        return QPoint(-1, -1);
+    const QPoint pos = area.topLeft() + QPoint(x, y);
+    x += w;
+    rowHeight = qMax(rowHeight, h);
+    return pos;
+}
+
+void QRhiImguiFontAtlas::copyImage(const QImage &src, const QPoint &pos)
+{
+    const QImage rgba = src.convertToFormat(QImage::Format_RGBA8888);
+    if (image.format() == QImage::Format_Grayscale8) {
+        for (int y = 0; y < rgba.height(); ++y) {
+            const uchar *s = rgba.constScanLine(y);
+            uchar *d = image.scanLine(pos.y() + y) + pos.x();
+            for (int x = 0; x < rgba.width(); ++x)
+                d[x] = s[x * 4 + 3];
+        }
+    } else {
+        for (int y = 0; y < rgba.height(); ++y)
+            memcpy(image.scanLine(pos.y() + y) + pos.x() * 4, rgba.constScanLine(y), rgba.width() * 4);
+    }
+}
+
+void QRhiImguiFontAtlas::extendGlyphRanges(int configIndex, const QVector<ImWchar> &codepoints)
+{
+    ImFontConfig &cfg(atlas.ConfigData[configIndex]);
+    ImFontGlyphRangesBuilder builder;
+    builder.AddRanges(cfg.GlyphRanges ? cfg.GlyphRanges : atlas.GetGlyphRangesDefault());
+    for (ImWchar c : codepoints)
+        builder.AddChar(c);
+    std::unique_ptr<ImVector<ImWchar>> ranges(new ImVector<ImWchar>);
+    builder.BuildRanges(ranges.get());
+    const ImWchar *oldRanges = cfg.GlyphRanges;
+    cfg.GlyphRanges = ranges->Data;
+    glyphRanges.push_back(std::move(ranges));
+    glyphRanges.erase(std::remove_if(glyphRanges.begin(), glyphRanges.end(),
+                                     [oldRanges](const std::unique_ptr<ImVector<ImWchar>> &r) { return r->Data == oldRanges; }),
+                      glyphRanges.end());
+}
+
+// Rasterizes the glyphs one by one into the free space, and adds them to the
+// fonts. The glyph ranges are extended as well, so that they survive a full
+// build, which is what happens when there is no more room.
+bool QRhiImguiFontAtlas::addGlyphs(const QString &text)
+{
+    if (atlas.Locked || image.isNull())
+        return false;
+
+    const QList<uint> codepoints = text.toUcs4();
+    QVector<QVector<ImWchar>> newGlyphs(atlas.ConfigData.Size);
+    FontInfos infos(atlas);
+    for (ImFont *font : atlas.Fonts) {
+        for (uint c : codepoints) {
+            if (c > IM_UNICODE_CODEPOINT_MAX || font->FindGlyphNoFallback(ImWchar(c)))
+                continue;
+            const int i = infos.configFor(font, c);
+            if (i >= 0)
+                newGlyphs[i].append(ImWchar(c));
+        }
+    }
+
+    QRect dirty;
+    bool outOfSpace = false;
+    QVarLengthArray<ImFont *, 4> changedFonts;
+    for (int i = 0; i < atlas.ConfigData.Size; ++i) {
+        QVector<ImWchar> &glyphs(newGlyphs[i]);
+        if (glyphs.isEmpty())
+            continue;
+        std::sort(glyphs.begin(), glyphs.end());
+        glyphs.erase(std::unique(glyphs.begin(), glyphs.end()), glyphs.end());
+        extendGlyphRanges(i, glyphs);
+        if (outOfSpace)
+            continue;
+
+        for (ImWchar c : glyphs) {
+            const QRect rect = rasterizeGlyph(atlas, &image, infos, i, c, distanceField,
+                                              [this](int w, int h) { return freeSpace.allocate(w, h); });
+            if (rect.isNull()) {
+                outOfSpace = true;
+                break;
+            }
+            ImFont *font = atlas.ConfigData[i].DstFont;
+            if (!changedFonts.contains(font))
+                changedFonts.append(font);
+            dirty |= rect;
+        }
+    }
+
+    if (outOfSpace) {
+        build();
+        return true;
+    }
+
+    for (ImFont *font : changedFonts)
+        font->BuildLookupTable();
+    if (!dirty.isEmpty())
+        updated(dirty);
+    return true;
+}
+
+int QRhiImguiFontAtlas::addImage(const QImage &src)
+{
+    if (atlas.Locked || image.isNull() || src.isNull())
+        return -1;
+
+    const int id = atlas.AddCustomRectRegular(src.width(), src.height());
+    customImages.insert(id, src);
+    ImFontAtlasCustomRect *r = atlas.GetCustomRectByIndex(id);
+    const int padding = atlas.TexGlyphPadding;
+    const QPoint pos = freeSpace.allocate(src.width() + padding, src.height() + padding);
+    if (pos.x() < 0) {
+        build();
+        return id;
+    }
+    r->X = pos.x();
+    r->Y = pos.y();
+    copyImage(src, pos);
+    updated(QRect(pos, src.size()));
+    return id;
+}
+
+void QRhiImguiFontAtlas::setGlyphCache(const ImWchar *ranges, int pageCount)
+{
+    glyphCacheRanges.clear();
+    if (ranges && pageCount > 0) {
+        ImFontGlyphRangesBuilder builder;
+        builder.AddRanges(ranges);
+        ImVector<ImWchar> r;
+        builder.BuildRanges(&r);
+        glyphCacheRanges = QVector<ImWchar>(r.begin(), r.end());
+    }
+    // a bit per page in the masks
+    glyphCachePageCount = glyphCacheRanges.isEmpty() ? 0 : qMin(pageCount, 64);
+}
+
+// Called by build(), starts with all glyphs in the ranges (that the build
+// did not include) as placeholders.
+void QRhiImguiFontAtlas::setUpGlyphCache()
+{
+    glyphCachePages.clear();
+    currentGlyphCachePage = 0;
+    glyphCacheBounds[0] = glyphCacheBounds[1] = 1.0f;
+    glyphCacheBounds[2] = glyphCacheBounds[3] = 0.0f;
+    for (int i = 0; i < glyphCachePageCount; ++i) {
+        const ImFontAtlasCustomRect *r = atlas.GetCustomRectByIndex(glyphCachePageRects[i]);
+        if (!r->IsPacked())
+            continue;
+        GlyphCachePage page;
+        page.rectId = glyphCachePageRects[i];
+        page.packer.reset(QRect(r->X, r->Y, r->Width, r->Height));
+        page.uv[0] = r->X / float(atlas.TexWidth);
+        page.uv[1] = r->Y / float(atlas.TexHeight);
+        page.uv[2] = (r->X + r->Width) / float(atlas.TexWidth);
+        page.uv[3] = (r->Y + r->Height) / float(atlas.TexHeight);
+        page.lastUsed = 0;
+        for (int j = 0; j < 2; ++j) {
+            glyphCacheBounds[j] = qMin(glyphCacheBounds[j], page.uv[j]);
+            glyphCacheBounds[j + 2] = qMax(glyphCacheBounds[j + 2], page.uv[j + 2]);
+        }
+        glyphCachePages.push_back(page);
+    }
+    if (glyphCachePages.empty())
+        return;
+
+    FontInfos infos(atlas);
+    for (int f = 0; f < atlas.Fonts.Size; ++f) {
+        ImFont *font = atlas.Fonts[f];
+        bool added = false;
+        for (const ImWchar *r = glyphCacheRanges.constData(); r[0]; r += 2) {
+            for (uint c = r[0]; c <= r[1]; ++c) {
+                if (font->FindGlyphNoFallback(ImWchar(c)))
+                    continue;
+                const int i = infos.configFor(font, c);
+                if (i < 0)
+                    continue;
+                // AddGlyph() clamps and snaps the advance like for the others
+                int advance, leftSideBearing;
+                stbtt_GetCodepointHMetrics(infos.get(i), int(c), &advance, &leftSideBearing);
+                font->AddGlyph(&atlas.ConfigData[i], ImWchar(c), 0, 0, 0, 0, 0, 0, 0, 0, advance * infos.scale(i));
+                setPlaceholder(&font->Glyphs.back(), f);
+                added = true;
+            }
+        }
+        if (added)
+            font->BuildLookupTable();
+    }
+}
+
+quint64 QRhiImguiFontAtlas::scanGlyphCache(ImDrawList *list, QVector<GlyphRequest> *missing) const
+{
+    const float *b = glyphCacheBounds;
+    quint64 pages = 0;
+    for (const ImDrawCmd &cmd : list->CmdBuffer) {
+        if (cmd.UserCallback || cmd.TextureId != atlas.TexID)
+            continue;
+        const ImDrawIdx *idx = list->IdxBuffer.Data + cmd.IdxOffset;
+        ImDrawVert *vtx = list->VtxBuffer.Data + cmd.VtxOffset;
+        for (quint32 i = 0; i < cmd.ElemCount; ++i) {
+            ImVec2 &uv(vtx[idx[i]].uv);
+            if (uv.x < 0.0f) {
+                const GlyphRequest r = { int(-1.0f - uv.y), ImWchar(int(-1.0f - uv.x)) };
+                // the 6 indices of the quad come one after the other
+                if (uv.y < 0.0f && (missing->isEmpty() || missing->last().font != r.font
+                                    || missing->last().codepoint != r.codepoint))
+                {
+                    missing->append(r);
+                }
+                // the quad has no area, any coordinates in range do
+                uv = atlas.TexUvWhitePixel;
+                continue;
+            }
+            if (uv.x < b[0] || uv.y < b[1] || uv.x > b[2] || uv.y > b[3])
+                continue;
+            for (size_t p = 0; p < glyphCachePages.size(); ++p) {
+                const float *r = glyphCachePages[p].uv;
+                if (uv.x >= r[0] && uv.y >= r[1] && uv.x <= r[2] && uv.y <= r[3]) {
+                    pages |= Q_UINT64_C(1) << p;
+                    break;
+                }
+            }
+        }
+    }
+    return pages;
+}
+
+void QRhiImguiFontAtlas::useGlyphCachePages(const void *user, quint64 pages)
+{
+    glyphCacheUsers[user] = pages;
+    ++glyphCacheClock;
+    for (size_t p = 0; p < glyphCachePages.size(); ++p) {
+        if (pages & (Q_UINT64_C(1) << p))
+            glyphCachePages[p].lastUsed = glyphCacheClock;
+    }
+}
+
+void QRhiImguiFontAtlas::releaseGlyphCacheUser(const void *user)
+{
+    glyphCacheUsers.remove(user);
+}
+
+// Returns the place in the current page, or in the least recently used page
+// that no user draws from, after evicting its glyphs. Pages are not cleared
+// on eviction, so the place is cleared instead: the rasterizer does not
+// write all of it (padding, empty glyphs).
+QPoint QRhiImguiFontAtlas::allocateInGlyphCache(int w, int h, quint64 inUse)
+{
+    if (w > GLYPH_CACHE_PAGE_SIZE || h > GLYPH_CACHE_PAGE_SIZE)
+        return QPoint(-1, -1);
+    QPoint pos = glyphCachePages[currentGlyphCachePage].packer.allocate(w, h);
+    if (pos.x() >= 0) {
+        clearCoverage(&image, QRect(pos, QSize(w, h)));
+        return pos;
+    }
+
+    int victim = -1;
+    for (int i = 0; i < int(glyphCachePages.size()); ++i) {
+        if (i == currentGlyphCachePage || (inUse & (Q_UINT64_C(1) << i)))
+            continue;
+        const GlyphCachePage &page(glyphCachePages[i]);
+        if (page.glyphs.isEmpty()) {
+            victim = i;
+            break;
+        }
+        if (victim < 0 || page.lastUsed < glyphCachePages[victim].lastUsed)
+            victim = i;
+    }
+    if (victim < 0)
+        return QPoint(-1, -1);
+
+    GlyphCachePage &page(glyphCachePages[victim]);
+    for (const GlyphRequest &g : page.glyphs) {
+        ImFont *font = atlas.Fonts[g.font];
+        if (ImFontGlyph *glyph = const_cast<ImFontGlyph *>(font->FindGlyphNoFallback(g.codepoint)))
+            setPlaceholder(glyph, g.font);
+    }
+    page.glyphs.clear();
+    page.packer.reset(page.packer.area);
+    currentGlyphCachePage = victim;
+    pos = page.packer.allocate(w, h);
+    if (pos.x() >= 0)
+        clearCoverage(&image, QRect(pos, QSize(w, h)));
+    return pos;
+}
+
+bool QRhiImguiFontAtlas::cacheGlyphs(QVector<GlyphRequest> requests)
+{
+    if (atlas.Locked || image.isNull() || glyphCachePages.empty())
+        return false;
+
+    std::sort(requests.begin(), requests.end(), [](const GlyphRequest &a, const GlyphRequest &b) {
+        return a.font < b.font || (a.font == b.font && a.codepoint < b.codepoint);
+    });
+    requests.erase(std::unique(requests.begin(), requests.end(), [](const GlyphRequest &a, const GlyphRequest &b) {
+        return a.font == b.font && a.codepoint == b.codepoint;
+    }), requests.end());
+
+    quint64 inUse = 0;
+    for (quint64 pages : glyphCacheUsers)
+        inUse |= pages;
+
+    FontInfos infos(atlas);
+    QHash<int, QRect> dirty; // per page
+    for (const GlyphRequest &r : requests) {
+        if (r.font < 0 || r.font >= atlas.Fonts.Size)
+            continue;
+        ImFont *font = atlas.Fonts[r.font];
+        const ImFontGlyph *glyph = font->FindGlyphNoFallback(r.codepoint);
+        if (!glyph || !isPlaceholder(glyph))
+            continue;
+        const int i = infos.configFor(font, r.codepoint);
+        if (i < 0)
+            continue;
+        const QRect rect = rasterizeGlyph(atlas, &image, infos, i, r.codepoint, distanceField,
+                                          [this, inUse](int w, int h) { return allocateInGlyphCache(w, h, inUse); });
+        if (rect.isNull())
+            continue;
+        replaceWithLastGlyph(font, r.codepoint);
+        GlyphCachePage &page(glyphCachePages[currentGlyphCachePage]);
+        page.glyphs.append(r);
+        page.lastUsed = ++glyphCacheClock;
+        dirty[currentGlyphCachePage] |= rect;
+    }
+
+    for (const QRect &rect : dirty)
+        updated(rect);
+    return !dirty.isEmpty();
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,121 @@
+// Copyright (C) 2022 The Qt Company Ltd.
+// SPDX-License-Identifier: LicenseRef-Qt-Commercial OR BSD-3-Clause
+
+#ifndef QRHIIMGUIFONTATLAS_P_H
+#define QRHIIMGUIFONTATLAS_P_H
+
+#include "qrhiimgui.h"
+#include <QtCore/qbytearraylist.h>
+#include <QtCore/qfile.h>
+#include <QtCore/qhash.h>
+#include <QtGui/qimage.h>
+
+#include "imgui.h"
+
+QT_BEGIN_NAMESPACE
+
+// The font atlas of one or more QRhiImgui instances. Not owned by the ImGui
+// contexts, see QRhiImgui::shareFontAtlas().
+struct QRhiImguiFontAtlas
+{
+    ImFontAtlas atlas;
+    // The atlas has FontDataOwnedByAtlas set to false for these. Usually
+    // raw data in the mapped fontFiles.
+    QByteArrayList fontData;
+    // copy of the atlas' pixels, Format_Grayscale8 (coverage) when
+    // singleChannel, Format_RGBA8888 otherwise
+    QImage image;
+    // unique across all atlases, identifies image
+    quint64 generation = 0;
+    // the generation of the last full build, updates are relative to that
+    quint64 baseGeneration = 0;
+    QVector<QRhiImguiRenderer::FontAtlasUpdate> updates;
+    bool singleChannel = false;
+    // glyphs are signed distance fields, see QRhiImgui::setDistanceFieldFonts()
+    bool distanceField = false;
+    // see QRhiImgui::setFontAtlasCacheDirectory()
+    QString cacheDirectory;
+
+    // Installs a builder that rasterizes on multiple threads.
+    QRhiImguiFontAtlas();
+
+    void build();
+    void clearFonts();
+    // Maps the opened file (falls back to reading it) and adds the contents
+    // to fontData.
+    QByteArray addFontFile(std::unique_ptr<QFile> f);
+    bool addGlyphs(const QString &text);
+    int addImage(const QImage &src);
+    void setDistanceField(bool enable);
+
+    // The glyph cache, see QRhiImgui::setGlyphCache(). Glyphs not cached are
+    // drawn as empty quads with the font index and the codepoint in their
+    // texture coordinates, scanGlyphCache() collects those and replaces the
+    // coordinates with ones in range, e.g. for the compact vertex format.
+    struct GlyphRequest {
+        int font; // index in atlas.Fonts
+        ImWchar codepoint;
+    };
+    void setGlyphCache(const ImWchar *ranges, int pageCount);
+    bool hasGlyphCache() const { return !glyphCachePages.empty(); }
+    // Returns the mask of the pages list draws from.
+    quint64 scanGlyphCache(ImDrawList *list, QVector<GlyphRequest> *missing) const;
+    // The pages user (a QRhiImgui) draws from in its current frame, these
+    // are not evicted.
+    void useGlyphCachePages(const void *user, quint64 pages);
+    void releaseGlyphCacheUser(const void *user);
+    // Returns true if any glyphs got added.
+    bool cacheGlyphs(QVector<GlyphRequest> requests);
+
+private:
+    // Fills area in rows from top to bottom.
+    struct ShelfPacker {
+        QRect area;
+        int x = 0;
+        int y = 0;
+        int rowHeight = 0;
+        void reset(const QRect &r) { area = r; x = 0; y = 0; rowHeight = 0; }
+        QPoint allocate(int w, int h);
+    };
+
+    struct GlyphCachePage {
+        int rectId; // custom rect in the atlas
+        ShelfPacker packer;
+        float uv[4]; // the rect in texture coordinates
+        quint64 lastUsed;
+        QVector<GlyphRequest> glyphs;
+    };
+
+    void updated(const QRect &rect);
+    void copyImage(const QImage &src, const QPoint &pos);
+    void extendGlyphRanges(int configIndex, const QVector<ImWchar> &codepoints);
+    QByteArray cacheKey() const;
+    bool loadCache(const QString &filename, const QByteArray &key);
+    void saveCache(const QString &filename, const QByteArray &key) const;
+    void setUpGlyphCache();
+    QPoint allocateInGlyphCache(int w, int h, quint64 inUse);
+
+    // Space not used by the build.
+    ShelfPacker freeSpace;
+    // replacements for the glyph ranges of the configs, so that a full build
+    // includes the glyphs added since
+    std::vector<std::unique_ptr<ImVector<ImWchar>>> glyphRanges;
+    std::vector<std::unique_ptr<QFile>> fontFiles;
+    // whether ImFontAtlasFlags_NoBakedLines was set before setDistanceField()
+    bool bitmapNoBakedLines = false;
+    // contents of the custom rects added by addImage()
+    QHash<int, QImage> customImages;
+
+    QVector<ImWchar> glyphCacheRanges;
+    int glyphCachePageCount = 0;
+    QVector<int> glyphCachePageRects; // ids of the custom rects for the pages
+    std::vector<GlyphCachePage> glyphCachePages;
+    float glyphCacheBounds[4] = {}; // all pages in texture coordinates
+    int currentGlyphCachePage = 0;
+    QHash<const void *, quint64> glyphCacheUsers;
+    quint64 glyphCacheClock = 0;
+};
+
+QT_END_NAMESPACE
+
+#endif
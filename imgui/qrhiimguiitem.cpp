@@ -3,6 +3,7 @@
 
 #include "qrhiimguiitem.h"
 #include "qrhiimgui.h"
+#include <QtCore/qtimer.h>
 #include <QtGui/qguiapplication.h>
 #include <QtQuick/qquickwindow.h>
 #if QT_VERSION >= QT_VERSION_CHECK(6, 6, 0)
@@ -132,9 +133,77 @@ struct QRhiImguiItemPrivate
     QRhiImgui gui;
     bool showDemoWindow = true;
 
+    // ImGui needs a few frames after input to settle (layout, hover state)
+    static const int SETTLE_FRAMES = 3;
+    bool renderOnDemand = false;
+    int activeFrames = SETTLE_FRAMES;
+    QTimer wakeUpTimer;
+    QSizeF lastSize;
+    QPointF lastScenePos;
+    float lastDpr = 0.0f;
+
     QRhiImguiItemPrivate(QRhiImguiItem *item) : q(item) { }
+
+    void nextFrame();
+    void wakeUp();
+    void processEvent(QEvent *event);
 };
 
+void QRhiImguiItemPrivate::nextFrame()
+{
+    const QSizeF size = q->size();
+    const QPointF scenePos = q->mapToScene(QPointF(0, 0));
+    const float dpr = window->effectiveDevicePixelRatio();
+
+    // Something else made the window render: new frames are only needed
+    // when ImGui asked for them or when the item's geometry changed.
+    if (renderOnDemand && activeFrames <= 0
+            && size == lastSize && scenePos == lastScenePos && dpr == lastDpr)
+    {
+        return;
+    }
+    lastSize = size;
+    lastScenePos = scenePos;
+    lastDpr = dpr;
+
+    gui.nextFrame(size, dpr, scenePos, [this] { q->frame(); });
+
+    if (renderOnDemand) {
+        const int delay = gui.nextFrameDelay();
+        if (gui.lastFrameChanged() || delay == 0)
+            activeFrames = SETTLE_FRAMES;
+        else
+            --activeFrames;
+        if (activeFrames <= 0) {
+            // Stop scheduling frames, and only update the item if this
+            // last frame is different from what is on screen.
+            if (delay > 0)
+                wakeUpTimer.start(delay);
+            if (!gui.lastFrameChanged())
+                return;
+        } else {
+            wakeUpTimer.stop();
+        }
+    }
+
+    q->update();
+    if (!window->isSceneGraphInitialized())
+        window->update();
+}
+
+void QRhiImguiItemPrivate::wakeUp()
+{
+    activeFrames = SETTLE_FRAMES;
+    q->update();
+}
+
+void QRhiImguiItemPrivate::processEvent(QEvent *event)
+{
+    gui.processEvent(event);
+    if (renderOnDemand)
+        wakeUp();
+}
+
 QRhiImguiItem::QRhiImguiItem(QQuickItem *parent)
     : QQuickItem(parent),
       d(new QRhiImguiItemPrivate(this))
@@ -142,6 +211,9 @@ QRhiImguiItem::QRhiImguiItem(QQuickItem *parent)
     setFlag(ItemHasContents, true);
     setAcceptedMouseButtons(Qt::LeftButton | Qt::RightButton);
     setAcceptHoverEvents(true);
+
+    d->wakeUpTimer.setSingleShot(true);
+    connect(&d->wakeUpTimer, &QTimer::timeout, this, [this] { d->wakeUp(); });
 }
 
 QRhiImguiItem::~QRhiImguiItem()
@@ -167,6 +239,12 @@ QSGNode *QRhiImguiItem::updatePaintNode(QSGNode *node, QQuickItem::UpdatePaintNo
     if (n->customRenderer)
         n->customRenderer->sync(n->renderer);
 
+    // Images finish loading and uploading without any input, so keep frames
+    // coming until they are done. Also for what the custom renderer just
+    // registered.
+    if (d->renderOnDemand && (d->gui.hasPendingImageWork() || n->renderer->hasPendingImageWork()))
+        QMetaObject::invokeMethod(this, [this] { d->wakeUp(); }, Qt::QueuedConnection);
+
     n->markDirty(QSGNode::DirtyMaterial);
     return n;
 }
@@ -181,54 +259,49 @@ void QRhiImguiItem::itemChange(QQuickItem::ItemChange change, const QQuickItem::
         if (changeData.window) {
             d->window = window();
             d->windowConn = connect(d->window, &QQuickWindow::afterAnimating, d->window, [this] {
-                if (isVisible()) {
-                    d->gui.nextFrame(size(),
-                                     d->window->effectiveDevicePixelRatio(),
-                                     mapToScene(QPointF(0, 0)),
-                                     [this] { frame(); });
-                    update();
-                    if (!d->window->isSceneGraphInitialized())
-                        d->window->update();
-                }
+                if (isVisible())
+                    d->nextFrame();
             });
         }
     }
+    if (change == QQuickItem::ItemVisibleHasChanged && d->renderOnDemand && changeData.boolValue)
+        d->wakeUp();
 }
 
 void QRhiImguiItem::keyPressEvent(QKeyEvent *event)
 {
-    d->gui.processEvent(event);
+    d->processEvent(event);
 }
 
 void QRhiImguiItem::keyReleaseEvent(QKeyEvent *event)
 {
-    d->gui.processEvent(event);
+    d->processEvent(event);
 }
 
 void QRhiImguiItem::mousePressEvent(QMouseEvent *event)
 {
     forceActiveFocus(Qt::MouseFocusReason);
-    d->gui.processEvent(event);
+    d->processEvent(event);
 }
 
 void QRhiImguiItem::mouseMoveEvent(QMouseEvent *event)
 {
-    d->gui.processEvent(event);
+    d->processEvent(event);
 }
 
 void QRhiImguiItem::mouseReleaseEvent(QMouseEvent *event)
 {
-    d->gui.processEvent(event);
+    d->processEvent(event);
 }
 
 void QRhiImguiItem::mouseDoubleClickEvent(QMouseEvent *event)
 {
-    d->gui.processEvent(event);
+    d->processEvent(event);
 }
 
 void QRhiImguiItem::wheelEvent(QWheelEvent *event)
 {
-    d->gui.processEvent(event);
+    d->processEvent(event);
 }
 
 void QRhiImguiItem::hoverMoveEvent(QHoverEvent *event)
@@ -243,12 +316,12 @@ void QRhiImguiItem::hoverMoveEvent(QHoverEvent *event)
     const QPointF globalOffset = mapToGlobal(event->position());
     QMouseEvent e(QEvent::MouseMove, event->position(), event->position() + sceneOffset, event->position() + globalOffset,
                   Qt::NoButton, Qt::NoButton, QGuiApplication::keyboardModifiers());
-    d->gui.processEvent(&e);
+    d->processEvent(&e);
 }
 
 void QRhiImguiItem::touchEvent(QTouchEvent *event)
 {
-    d->gui.processEvent(event);
+    d->processEvent(event);
 }
 
 QRhiImgui *QRhiImguiItem::imgui()
@@ -256,6 +329,32 @@ QRhiImgui *QRhiImguiItem::imgui()
     return &d->gui;
 }
 
+bool QRhiImguiItem::renderOnDemand() const
+{
+    return d->renderOnDemand;
+}
+
+// When enabled, the item stops scheduling new frames when there is no input,
+// ImGui has nothing to animate, and the UI did not change in the last few
+// frames. Call requestFrame() when frame() would generate something different
+// due to external changes.
+void QRhiImguiItem::setRenderOnDemand(bool enable)
+{
+    if (d->renderOnDemand == enable)
+        return;
+
+    d->renderOnDemand = enable;
+    if (!enable)
+        d->wakeUpTimer.stop();
+    d->wakeUp();
+    emit renderOnDemandChanged();
+}
+
+void QRhiImguiItem::requestFrame()
+{
+    d->wakeUp();
+}
+
 void QRhiImguiItem::frame()
 {
     ImGui::ShowDemoWindow(&d->showDemoWindow);
@@ -23,6 +23,7 @@ public:
 class QRhiImguiItem : public QQuickItem
 {
     Q_OBJECT
+    Q_PROPERTY(bool renderOnDemand READ renderOnDemand WRITE setRenderOnDemand NOTIFY renderOnDemandChanged)
 
 public:
     QRhiImguiItem(QQuickItem *parent = nullptr);
@@ -33,6 +34,15 @@ public:
 
     QRhiImgui *imgui();
 
+    bool renderOnDemand() const;
+    void setRenderOnDemand(bool enable);
+    // Wakes the item in render on demand mode, e.g. after a change in what
+    // frame() shows. Also callable from QML.
+    Q_INVOKABLE void requestFrame();
+
+Q_SIGNALS:
+    void renderOnDemandChanged();
+
 private:
     QSGNode *updatePaintNode(QSGNode *, UpdatePaintNodeData *) override;
     void itemChange(QQuickItem::ItemChange, const QQuickItem::ItemChangeData &) override;
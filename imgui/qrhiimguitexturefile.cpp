@@ -0,0 +1,583 @@
+// Copyright (C) 2022 The Qt Company Ltd.
+// SPDX-License-Identifier: LicenseRef-Qt-Commercial OR BSD-3-Clause
+
+#include "qrhiimguitexturefile_p.h"
+#include <QtCore/qendian.h>
+#include <QtCore/qfile.h>
+
+QT_BEGIN_NAMESPACE
+
+static const char KTX1_IDENTIFIER[12] = { '\xAB', 'K', 'T', 'X', ' ', '1', '1', '\xBB', '\r', '\n', '\x1A', '\n' };
+static const char KTX2_IDENTIFIER[12] = { '\xAB', 'K', 'T', 'X', ' ', '2', '0', '\xBB', '\r', '\n', '\x1A', '\n' };
+
+// in the order of both the GL and the Vulkan format values
+static const QRhiTexture::Format ASTC_FORMATS[14] = {
+    QRhiTexture::ASTC_4x4, QRhiTexture::ASTC_5x4, QRhiTexture::ASTC_5x5, QRhiTexture::ASTC_6x5,
+    QRhiTexture::ASTC_6x6, QRhiTexture::ASTC_8x5, QRhiTexture::ASTC_8x6, QRhiTexture::ASTC_8x8,
+    QRhiTexture::ASTC_10x5, QRhiTexture::ASTC_10x6, QRhiTexture::ASTC_10x8, QRhiTexture::ASTC_10x10,
+    QRhiTexture::ASTC_12x10, QRhiTexture::ASTC_12x12
+};
+static const int ASTC_BLOCK_SIZES[14][2] = {
+    { 4, 4 }, { 5, 4 }, { 5, 5 }, { 6, 5 }, { 6, 6 }, { 8, 5 }, { 8, 6 }, { 8, 8 },
+    { 10, 5 }, { 10, 6 }, { 10, 8 }, { 10, 10 }, { 12, 10 }, { 12, 12 }
+};
+
+// glInternalFormat of KTX1. The sRGB variants map to the same formats, as
+// the textures of registered images are never sRGB. opaqueBc1 is set for
+// the BC1 formats without alpha.
+static QRhiTexture::Format formatFromGL(quint32 internalFormat, bool *opaqueBc1)
+{
+    *opaqueBc1 = internalFormat == 0x83F0 || internalFormat == 0x8C4C;
+    switch (internalFormat) {
+    case 0x8058: // GL_RGBA8
+    case 0x8C43: // GL_SRGB8_ALPHA8
+        return QRhiTexture::RGBA8;
+    case 0x83F0: // GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+    case 0x83F1: // GL_COMPRESSED_RGBA_S3TC_DXT1_EXT
+    case 0x8C4C: // GL_COMPRESSED_SRGB_S3TC_DXT1_EXT
+    case 0x8C4D: // GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT
+        return QRhiTexture::BC1;
+    case 0x83F2: // GL_COMPRESSED_RGBA_S3TC_DXT3_EXT
+    case 0x8C4E: // GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT
+        return QRhiTexture::BC2;
+    case 0x83F3: // GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+    case 0x8C4F: // GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT
+        return QRhiTexture::BC3;
+    case 0x8DBB: // GL_COMPRESSED_RED_RGTC1
+        return QRhiTexture::BC4;
+    case 0x8DBD: // GL_COMPRESSED_RG_RGTC2
+        return QRhiTexture::BC5;
+    case 0x8E8F: // GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT
+        return QRhiTexture::BC6H;
+    case 0x8E8C: // GL_COMPRESSED_RGBA_BPTC_UNORM
+    case 0x8E8D: // GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM
+        return QRhiTexture::BC7;
+    case 0x8D64: // GL_ETC1_RGB8_OES, a subset of ETC2
+    case 0x9274: // GL_COMPRESSED_RGB8_ETC2
+    case 0x9275: // GL_COMPRESSED_SRGB8_ETC2
+        return QRhiTexture::ETC2_RGB8;
+    case 0x9276: // GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2
+    case 0x9277: // GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2
+        return QRhiTexture::ETC2_RGB8A1;
+    case 0x9278: // GL_COMPRESSED_RGBA8_ETC2_EAC
+    case 0x9279: // GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC
+        return QRhiTexture::ETC2_RGBA8;
+    default:
+        break;
+    }
+    if (internalFormat >= 0x93B0 && internalFormat <= 0x93BD) // GL_COMPRESSED_RGBA_ASTC_*_KHR
+        return ASTC_FORMATS[internalFormat - 0x93B0];
+    if (internalFormat >= 0x93D0 && internalFormat <= 0x93DD) // GL_COMPRESSED_SRGB8_ALPHA8_ASTC_*_KHR
+        return ASTC_FORMATS[internalFormat - 0x93D0];
+    return QRhiTexture::UnknownFormat;
+}
+
+// vkFormat of KTX2, the same as above
+static QRhiTexture::Format formatFromVulkan(quint32 vkFormat, bool *opaqueBc1)
+{
+    *opaqueBc1 = vkFormat == 131 || vkFormat == 132;
+    switch (vkFormat) {
+    case 37: // VK_FORMAT_R8G8B8A8_UNORM
+    case 43: // VK_FORMAT_R8G8B8A8_SRGB
+        return QRhiTexture::RGBA8;
+    case 131: // VK_FORMAT_BC1_RGB_UNORM_BLOCK
+    case 132: // VK_FORMAT_BC1_RGB_SRGB_BLOCK
+    case 133: // VK_FORMAT_BC1_RGBA_UNORM_BLOCK
+    case 134: // VK_FORMAT_BC1_RGBA_SRGB_BLOCK
+        return QRhiTexture::BC1;
+    case 135: // VK_FORMAT_BC2_UNORM_BLOCK
+    case 136: // VK_FORMAT_BC2_SRGB_BLOCK
+        return QRhiTexture::BC2;
+    case 137: // VK_FORMAT_BC3_UNORM_BLOCK
+    case 138: // VK_FORMAT_BC3_SRGB_BLOCK
+        return QRhiTexture::BC3;
+    case 139: // VK_FORMAT_BC4_UNORM_BLOCK
+        return QRhiTexture::BC4;
+    case 141: // VK_FORMAT_BC5_UNORM_BLOCK
+        return QRhiTexture::BC5;
+    case 143: // VK_FORMAT_BC6H_UFLOAT_BLOCK
+        return QRhiTexture::BC6H;
+    case 145: // VK_FORMAT_BC7_UNORM_BLOCK
+    case 146: // VK_FORMAT_BC7_SRGB_BLOCK
+        return QRhiTexture::BC7;
+    case 147: // VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK
+    case 148: // VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK
+        return QRhiTexture::ETC2_RGB8;
+    case 149: // VK_FORMAT_ETC2_R8G8B8A1_UNORM_BLOCK
+    case 150: // VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK
+        return QRhiTexture::ETC2_RGB8A1;
+    case 151: // VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK
+    case 152: // VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK
+        return QRhiTexture::ETC2_RGBA8;
+    default:
+        break;
+    }
+    if (vkFormat >= 157 && vkFormat <= 184) // VK_FORMAT_ASTC_*_UNORM_BLOCK and _SRGB_BLOCK
+        return ASTC_FORMATS[(vkFormat - 157) / 2];
+    return QRhiTexture::UnknownFormat;
+}
+
+// Returns the bytes per block, 4 per pixel for RGBA8.
+static int blockSize(QRhiTexture::Format format, int *blockWidth, int *blockHeight)
+{
+    *blockWidth = 4;
+    *blockHeight = 4;
+    switch (format) {
+    case QRhiTexture::RGBA8:
+        *blockWidth = 1;
+        *blockHeight = 1;
+        return 4;
+    case QRhiTexture::BC1:
+    case QRhiTexture::BC4:
+    case QRhiTexture::ETC2_RGB8:
+    case QRhiTexture::ETC2_RGB8A1:
+        return 8;
+    default:
+        break;
+    }
+    for (int i = 0; i < 14; ++i) {
+        if (ASTC_FORMATS[i] == format) {
+            *blockWidth = ASTC_BLOCK_SIZES[i][0];
+            *blockHeight = ASTC_BLOCK_SIZES[i][1];
+        }
+    }
+    return 16;
+}
+
+static quint64 levelByteSize(QRhiTexture::Format format, const QSize &size, int level)
+{
+    int bw, bh;
+    const int bytes = blockSize(format, &bw, &bh);
+    const quint64 w = qMax(1, size.width() >> level);
+    const quint64 h = qMax(1, size.height() >> level);
+    return ((w + bw - 1) / bw) * ((h + bh - 1) / bh) * bytes;
+}
+
+// Both return an error, nullptr on success.
+static const char *parseKtx1(const QByteArray &data, QRhiImguiTextureFile *file)
+{
+    if (data.size() < 64)
+        return "truncated header";
+    const uchar *p = reinterpret_cast<const uchar *>(data.constData());
+    // 0x04030201 in the byte order of the writer
+    const bool bigEndian = qFromLittleEndian<quint32>(p + 12) == 0x01020304;
+    auto read = [p, bigEndian](qint64 offset) {
+        return bigEndian ? qFromBigEndian<quint32>(p + offset) : qFromLittleEndian<quint32>(p + offset);
+    };
+    const quint32 glType = read(16);
+    const quint32 glFormat = read(24);
+    const quint32 glInternalFormat = read(28);
+    const quint32 width = read(36);
+    const quint32 height = read(40);
+    if (width == 0 || height == 0 || width > 65536 || height > 65536 || read(44) > 1 || read(48) != 0 || read(52) != 1)
+        return "not a 2D texture";
+    if (glType != 0) {
+        // uncompressed, only GL_RGBA / GL_UNSIGNED_BYTE
+        file->format = glType == 0x1401 && glFormat == 0x1908 ? QRhiTexture::RGBA8 : QRhiTexture::UnknownFormat;
+    } else {
+        file->format = formatFromGL(glInternalFormat, &file->opaqueBc1);
+    }
+    if (file->format == QRhiTexture::UnknownFormat)
+        return "unsupported format";
+    file->size = QSize(int(width), int(height));
+    const int levelCount = qMax(1, int(qMin(read(56), 17u)));
+    qint64 offset = 64 + qint64(read(60));
+    for (int level = 0; level < levelCount; ++level) {
+        if (offset + 4 > data.size())
+            return "truncated level data";
+        const quint64 imageSize = read(offset);
+        offset += 4;
+        const quint64 expected = levelByteSize(file->format, file->size, level);
+        if (imageSize < expected || quint64(offset) + imageSize > quint64(data.size()))
+            return "truncated level data";
+        file->levels.append(data.mid(offset, qsizetype(expected)));
+        offset += qint64((imageSize + 3) & ~quint64(3));
+    }
+    return nullptr;
+}
+
+static const char *parseKtx2(const QByteArray &data, QRhiImguiTextureFile *file)
+{
+    if (data.size() < 80)
+        return "truncated header";
+    const uchar *p = reinterpret_cast<const uchar *>(data.constData());
+    const quint32 vkFormat = qFromLittleEndian<quint32>(p + 12);
+    const quint32 width = qFromLittleEndian<quint32>(p + 20);
+    const quint32 height = qFromLittleEndian<quint32>(p + 24);
+    const quint32 depth = qFromLittleEndian<quint32>(p + 28);
+    const quint32 layerCount = qFromLittleEndian<quint32>(p + 32);
+    const quint32 faceCount = qFromLittleEndian<quint32>(p + 36);
+    const int levelCount = qMax(1, int(qMin(qFromLittleEndian<quint32>(p + 40), 17u)));
+    if (width == 0 || height == 0 || width > 65536 || height > 65536 || depth != 0 || layerCount != 0 || faceCount != 1)
+        return "not a 2D texture";
+    if (qFromLittleEndian<quint32>(p + 44) != 0)
+        return "supercompression is not supported";
+    file->format = formatFromVulkan(vkFormat, &file->opaqueBc1);
+    if (file->format == QRhiTexture::UnknownFormat)
+        return "unsupported format";
+    file->size = QSize(int(width), int(height));
+    if (80 + levelCount * 24 > data.size())
+        return "truncated level index";
+    for (int level = 0; level < levelCount; ++level) {
+        const uchar *entry = p + 80 + level * 24;
+        const quint64 offset = qFromLittleEndian<quint64>(entry);
+        const quint64 length = qFromLittleEndian<quint64>(entry + 8);
+        const quint64 expected = levelByteSize(file->format, file->size, level);
+        if (length < expected || offset > quint64(data.size()) || quint64(data.size()) - offset < expected)
+            return "truncated level data";
+        file->levels.append(data.mid(qsizetype(offset), qsizetype(expected)));
+    }
+    return nullptr;
+}
+
+bool QRhiImguiTextureFile::load(const QString &filename)
+{
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadOnly)) {
+        qWarning("Failed to open texture file %s", qPrintable(filename));
+        return false;
+    }
+    const QByteArray data = f.readAll();
+    const char *error = "not a KTX file";
+    if (data.startsWith(QByteArray::fromRawData(KTX1_IDENTIFIER, 12)))
+        error = parseKtx1(data, this);
+    else if (data.startsWith(QByteArray::fromRawData(KTX2_IDENTIFIER, 12)))
+        error = parseKtx2(data, this);
+    if (error) {
+        qWarning("Failed to load texture file %s: %s", qPrintable(filename), error);
+        levels.clear();
+        return false;
+    }
+    return true;
+}
+
+bool QRhiImguiTextureFile::isDecodable() const
+{
+    switch (format) {
+    case QRhiTexture::RGBA8:
+    case QRhiTexture::BC1:
+    case QRhiTexture::BC2:
+    case QRhiTexture::BC3:
+    case QRhiTexture::BC4:
+    case QRhiTexture::BC5:
+    case QRhiTexture::ETC2_RGB8:
+    case QRhiTexture::ETC2_RGB8A1:
+    case QRhiTexture::ETC2_RGBA8:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// The decoders write one 4x4 block, RGBA per pixel, rows from the top.
+typedef uchar BlockPixels[16][4];
+
+static inline uchar clampColor(int v)
+{
+    return uchar(qBound(0, v, 255));
+}
+
+// BC1 also has the color part of BC2 and BC3, which always use 4 colors.
+// BC1 blocks with c0 <= c1 have 3 colors and black, transparent unless
+// the format has no alpha.
+enum Bc1Mode {
+    Bc1FourColors,
+    Bc1Opaque,
+    Bc1Punchthrough
+};
+
+static void decodeBc1Colors(const uchar *block, BlockPixels &out, Bc1Mode mode)
+{
+    const quint16 c[2] = { qFromLittleEndian<quint16>(block), qFromLittleEndian<quint16>(block + 2) };
+    uchar colors[4][4];
+    for (int i = 0; i < 2; ++i) {
+        const int r = c[i] >> 11;
+        const int g = (c[i] >> 5) & 0x3f;
+        const int b = c[i] & 0x1f;
+        colors[i][0] = uchar((r << 3) | (r >> 2));
+        colors[i][1] = uchar((g << 2) | (g >> 4));
+        colors[i][2] = uchar((b << 3) | (b >> 2));
+        colors[i][3] = 255;
+    }
+    if (c[0] > c[1] || mode == Bc1FourColors) {
+        for (int i = 0; i < 3; ++i) {
+            colors[2][i] = uchar((2 * colors[0][i] + colors[1][i]) / 3);
+            colors[3][i] = uchar((colors[0][i] + 2 * colors[1][i]) / 3);
+        }
+        colors[2][3] = colors[3][3] = 255;
+    } else {
+        for (int i = 0; i < 3; ++i)
+            colors[2][i] = uchar((colors[0][i] + colors[1][i]) / 2);
+        colors[2][3] = 255;
+        memset(colors[3], 0, 3);
+        colors[3][3] = mode == Bc1Opaque ? 255 : 0;
+    }
+    const quint32 indices = qFromLittleEndian<quint32>(block + 4);
+    for (int i = 0; i < 16; ++i)
+        memcpy(out[i], colors[(indices >> (2 * i)) & 3], 4);
+}
+
+// BC4, also the alpha of BC3 and the channels of BC5
+static void decodeBc4Channel(const uchar *block, BlockPixels &out, int channel)
+{
+    const int a0 = block[0];
+    const int a1 = block[1];
+    int values[8] = { a0, a1 };
+    if (a0 > a1) {
+        for (int i = 1; i < 7; ++i)
+            values[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+    } else {
+        for (int i = 1; i < 5; ++i)
+            values[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+        values[6] = 0;
+        values[7] = 255;
+    }
+    quint64 indices = 0;
+    for (int i = 0; i < 6; ++i)
+        indices |= quint64(block[2 + i]) << (8 * i);
+    for (int i = 0; i < 16; ++i)
+        out[i][channel] = uchar(values[(indices >> (3 * i)) & 7]);
+}
+
+static const int ETC1_MODIFIERS[8][2] = {
+    { 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 }, { 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 }
+};
+static const int ETC2_DISTANCES[8] = { 3, 6, 11, 16, 23, 32, 41, 64 };
+static const int EAC_MODIFIERS[16][8] = {
+    { -3, -6, -9, -15, 2, 5, 8, 14 }, { -3, -7, -10, -13, 2, 6, 9, 12 },
+    { -2, -5, -8, -13, 1, 4, 7, 12 }, { -2, -4, -6, -13, 1, 3, 5, 12 },
+    { -3, -6, -8, -12, 2, 5, 7, 11 }, { -3, -7, -9, -11, 2, 6, 8, 10 },
+    { -4, -7, -8, -11, 3, 6, 7, 10 }, { -3, -5, -8, -11, 2, 4, 7, 10 },
+    { -2, -6, -8, -10, 1, 5, 7, 9 }, { -2, -5, -8, -10, 1, 4, 7, 9 },
+    { -2, -4, -8, -10, 1, 3, 7, 9 }, { -2, -5, -7, -10, 1, 4, 6, 9 },
+    { -3, -4, -7, -10, 2, 3, 6, 9 }, { -1, -2, -3, -10, 0, 1, 2, 9 },
+    { -4, -6, -8, -9, 3, 5, 7, 8 }, { -3, -5, -7, -9, 2, 4, 6, 8 }
+};
+
+static inline int extendBits(int v, int bits)
+{
+    return (v << (8 - bits)) | (v >> (2 * bits - 8));
+}
+
+// The RGB part of the ETC2 formats, ETC1 blocks included. With punchthrough
+// alpha the differential bit says whether the block is opaque instead.
+static void decodeEtc2Colors(const uchar *b, BlockPixels &out, bool punchthrough)
+{
+    const bool opaque = !punchthrough || (b[3] & 2);
+    const bool differential = punchthrough || (b[3] & 2);
+    const int msbs = (b[4] << 8) | b[5];
+    const int lsbs = (b[6] << 8) | b[7];
+    // pixels are in column order in the index bits
+    auto pixelIndex = [msbs, lsbs](int x, int y) {
+        const int bit = x * 4 + y;
+        return (((msbs >> bit) & 1) << 1) | ((lsbs >> bit) & 1);
+    };
+    auto put = [&out](int x, int y, int r, int g, int bl, int a) {
+        uchar *pixel = out[y * 4 + x];
+        pixel[0] = clampColor(r);
+        pixel[1] = clampColor(g);
+        pixel[2] = clampColor(bl);
+        pixel[3] = uchar(a);
+    };
+
+    int base[2][3];
+    if (differential) {
+        const int r = b[0] >> 3;
+        const int g = b[1] >> 3;
+        const int bl = b[2] >> 3;
+        const int dr = ((b[0] & 7) ^ 4) - 4;
+        const int dg = ((b[1] & 7) ^ 4) - 4;
+        const int db = ((b[2] & 7) ^ 4) - 4;
+        const bool rOverflow = r + dr < 0 || r + dr > 31;
+        const bool gOverflow = g + dg < 0 || g + dg > 31;
+        const bool bOverflow = bl + db < 0 || bl + db > 31;
+        if (rOverflow || gOverflow) {
+            // T and H modes, four paint colors from two base colors
+            int c[2][3];
+            int distance;
+            if (rOverflow) {
+                c[0][0] = extendBits(((b[0] >> 1) & 0xc) | (b[0] & 3), 4);
+                c[0][1] = extendBits(b[1] >> 4, 4);
+                c[0][2] = extendBits(b[1] & 0xf, 4);
+                c[1][0] = extendBits(b[2] >> 4, 4);
+                c[1][1] = extendBits(b[2] & 0xf, 4);
+                c[1][2] = extendBits(b[3] >> 4, 4);
+                distance = ETC2_DISTANCES[(((b[3] >> 2) & 3) << 1) | (b[3] & 1)];
+            } else {
+                c[0][0] = extendBits((b[0] >> 3) & 0xf, 4);
+                c[0][1] = extendBits(((b[0] & 7) << 1) | ((b[1] >> 4) & 1), 4);
+                c[0][2] = extendBits((b[1] & 8) | ((b[1] & 3) << 1) | (b[2] >> 7), 4);
+                c[1][0] = extendBits((b[2] >> 3) & 0xf, 4);
+                c[1][1] = extendBits(((b[2] & 7) << 1) | (b[3] >> 7), 4);
+                c[1][2] = extendBits((b[3] >> 3) & 0xf, 4);
+                int index = (b[3] & 4) | ((b[3] & 1) << 1);
+                if (((c[0][0] << 16) | (c[0][1] << 8) | c[0][2]) >= ((c[1][0] << 16) | (c[1][1] << 8) | c[1][2]))
+                    index |= 1;
+                distance = ETC2_DISTANCES[index];
+            }
+            int paint[4][3];
+            for (int i = 0; i < 3; ++i) {
+                if (rOverflow) {
+                    paint[0][i] = c[0][i];
+                    paint[1][i] = c[1][i] + distance;
+                    paint[2][i] = c[1][i];
+                    paint[3][i] = c[1][i] - distance;
+                } else {
+                    paint[0][i] = c[0][i] + distance;
+                    paint[1][i] = c[0][i] - distance;
+                    paint[2][i] = c[1][i] + distance;
+                    paint[3][i] = c[1][i] - distance;
+                }
+            }
+            for (int y = 0; y < 4; ++y) {
+                for (int x = 0; x < 4; ++x) {
+                    const int index = pixelIndex(x, y);
+                    if (!opaque && index == 2)
+                        put(x, y, 0, 0, 0, 0);
+                    else
+                        put(x, y, paint[index][0], paint[index][1], paint[index][2], 255);
+                }
+            }
+            return;
+        }
+        if (bOverflow) {
+            // planar mode, a gradient from three colors, always opaque
+            const int o[3] = {
+                extendBits((b[0] >> 1) & 0x3f, 6),
+                extendBits(((b[0] & 1) << 6) | ((b[1] >> 1) & 0x3f), 7),
+                extendBits(((b[1] & 1) << 5) | (b[2] & 0x18) | ((b[2] & 3) << 1) | (b[3] >> 7), 6)
+            };
+            const int h[3] = {
+                extendBits(((b[3] >> 1) & 0x3e) | (b[3] & 1), 6),
+                extendBits((b[4] >> 1) & 0x7f, 7),
+                extendBits(((b[4] & 1) << 5) | (b[5] >> 3), 6)
+            };
+            const int v[3] = {
+                extendBits(((b[5] & 7) << 3) | (b[6] >> 5), 6),
+                extendBits(((b[6] & 0x1f) << 2) | (b[7] >> 6), 7),
+                extendBits(b[7] & 0x3f, 6)
+            };
+            for (int y = 0; y < 4; ++y) {
+                for (int x = 0; x < 4; ++x) {
+                    int c[3];
+                    for (int i = 0; i < 3; ++i)
+                        c[i] = (x * (h[i] - o[i]) + y * (v[i] - o[i]) + 4 * o[i] + 2) / 4;
+                    put(x, y, c[0], c[1], c[2], 255);
+                }
+            }
+            return;
+        }
+        base[0][0] = extendBits(r, 5);
+        base[0][1] = extendBits(g, 5);
+        base[0][2] = extendBits(bl, 5);
+        base[1][0] = extendBits(r + dr, 5);
+        base[1][1] = extendBits(g + dg, 5);
+        base[1][2] = extendBits(bl + db, 5);
+    } else {
+        for (int i = 0; i < 3; ++i) {
+            base[0][i] = extendBits(b[i] >> 4, 4);
+            base[1][i] = extendBits(b[i] & 0xf, 4);
+        }
+    }
+    // two 2x4 or 4x2 sub-blocks, each with a base color and modifier table
+    const int tables[2] = { (b[3] >> 5) & 7, (b[3] >> 2) & 7 };
+    const bool flip = b[3] & 1;
+    for (int y = 0; y < 4; ++y) {
+        for (int x = 0; x < 4; ++x) {
+            const int sub = flip ? y / 2 : x / 2;
+            const int index = pixelIndex(x, y);
+            if (!opaque && index == 2) {
+                put(x, y, 0, 0, 0, 0);
+                continue;
+            }
+            int modifier = ETC1_MODIFIERS[tables[sub]][index & 1];
+            if (index & 2)
+                modifier = -modifier;
+            if (!opaque && index == 0)
+                modifier = 0;
+            put(x, y, base[sub][0] + modifier, base[sub][1] + modifier, base[sub][2] + modifier, 255);
+        }
+    }
+}
+
+static void decodeEacAlpha(const uchar *b, BlockPixels &out)
+{
+    const int base = b[0];
+    const int multiplier = b[1] >> 4;
+    const int *modifiers = EAC_MODIFIERS[b[1] & 0xf];
+    quint64 indices = 0;
+    for (int i = 0; i < 6; ++i)
+        indices = (indices << 8) | b[2 + i];
+    // in column order from the most significant bits
+    for (int i = 0; i < 16; ++i) {
+        const int index = int(indices >> (45 - 3 * i)) & 7;
+        out[(i % 4) * 4 + i / 4][3] = clampColor(base + modifiers[index] * multiplier);
+    }
+}
+
+QImage QRhiImguiTextureFile::decode() const
+{
+    if (!isDecodable() || levels.isEmpty())
+        return QImage();
+    const uchar *src = reinterpret_cast<const uchar *>(levels.first().constData());
+    if (format == QRhiTexture::RGBA8)
+        return QImage(src, size.width(), size.height(), size.width() * 4, QImage::Format_RGBA8888).copy();
+
+    QImage image(size, QImage::Format_RGBA8888);
+    if (image.isNull())
+        return image;
+    int bw, bh;
+    const int bytes = blockSize(format, &bw, &bh);
+    BlockPixels pixels;
+    for (int by = 0; by < size.height(); by += 4) {
+        for (int bx = 0; bx < size.width(); bx += 4) {
+            switch (format) {
+            case QRhiTexture::BC1:
+                decodeBc1Colors(src, pixels, opaqueBc1 ? Bc1Opaque : Bc1Punchthrough);
+                break;
+            case QRhiTexture::BC2: {
+                decodeBc1Colors(src + 8, pixels, Bc1FourColors);
+                const quint64 alpha = qFromLittleEndian<quint64>(src);
+                for (int i = 0; i < 16; ++i)
+                    pixels[i][3] = uchar(((alpha >> (4 * i)) & 0xf) * 17);
+                break;
+            }
+            case QRhiTexture::BC3:
+                decodeBc1Colors(src + 8, pixels, Bc1FourColors);
+                decodeBc4Channel(src, pixels, 3);
+                break;
+            case QRhiTexture::BC4:
+            case QRhiTexture::BC5:
+                // what sampling the R8 and RG8 like textures gives
+                for (int i = 0; i < 16; ++i) {
+                    pixels[i][1] = pixels[i][2] = 0;
+                    pixels[i][3] = 255;
+                }
+                decodeBc4Channel(src, pixels, 0);
+                if (format == QRhiTexture::BC5)
+                    decodeBc4Channel(src + 8, pixels, 1);
+                break;
+            case QRhiTexture::ETC2_RGB8:
+                decodeEtc2Colors(src, pixels, false);
+                break;
+            case QRhiTexture::ETC2_RGB8A1:
+                decodeEtc2Colors(src, pixels, true);
+                break;
+            case QRhiTexture::ETC2_RGBA8:
+                decodeEtc2Colors(src + 8, pixels, false);
+                decodeEacAlpha(src, pixels);
+                break;
+            default:
+                break;
+            }
+            src += bytes;
+            const int w = qMin(4, size.width() - bx);
+            const int h = qMin(4, size.height() - by);
+            for (int y = 0; y < h; ++y)
+                memcpy(image.scanLine(by + y) + bx * 4, pixels[y * 4], size_t(w) * 4);
+        }
+    }
+    return image;
+}
+
+QT_END_NAMESPACE
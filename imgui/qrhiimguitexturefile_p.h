@@ -0,0 +1,37 @@
+// Copyright (C) 2022 The Qt Company Ltd.
+// SPDX-License-Identifier: LicenseRef-Qt-Commercial OR BSD-3-Clause
+
+#ifndef QRHIIMGUITEXTUREFILE_P_H
+#define QRHIIMGUITEXTUREFILE_P_H
+
+#include "qrhiimgui.h"
+#include <QtCore/qbytearraylist.h>
+#include <QtGui/qimage.h>
+
+QT_BEGIN_NAMESPACE
+
+// The contents of a KTX or KTX2 file, see
+// QRhiImguiRenderer::registerCompressedTextureFile(). 2D only, with one
+// layer and face, and no supercompression.
+struct QRhiImguiTextureFile
+{
+    QRhiTexture::Format format = QRhiTexture::UnknownFormat;
+    QSize size;
+    // BC1 without alpha (e.g. GL_COMPRESSED_RGB_S3TC_DXT1_EXT), decoding
+    // gives opaque black where BC1 with alpha is transparent
+    bool opaqueBc1 = false;
+    // mip levels as they are in the file, level 0 first
+    QByteArrayList levels;
+
+    // Warns and returns false when the file is not one of the above, or
+    // has a format without a QRhiTexture equivalent.
+    bool load(const QString &filename);
+    // Whether decode() handles format.
+    bool isDecodable() const;
+    // Level 0 as Format_RGBA8888, null when not decodable.
+    QImage decode() const;
+};
+
+QT_END_NAMESPACE
+
+#endif